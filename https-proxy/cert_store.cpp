@@ -1,13 +1,18 @@
 #include "cert_store.hpp"
+#include "sign_offload.hpp"
 #include <openssl/bio.h>
 #include <openssl/bn.h>
 #include <openssl/x509v3.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -20,7 +25,80 @@ cert_store& cert_store::instance() {
 cert_store::cert_store()
     : ca_cert_(nullptr, X509_free)
     , ca_key_(nullptr, EVP_PKEY_free)
-    , ca_loaded_(false) {
+    , leaf_key_(nullptr, EVP_PKEY_free)
+    , ca_loaded_(false)
+    , key_type_(key_type::P256)
+    , stopping_(false) {
+}
+
+bool cert_store::parse_key_type(std::string_view name, key_type& out) {
+    if (name == "p256") {
+        out = key_type::P256;
+    } else if (name == "ed25519") {
+        out = key_type::ED25519;
+    } else if (name == "rsa2048") {
+        out = key_type::RSA2048;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* cert_store::key_type_name(key_type type) {
+    switch (type) {
+        case key_type::P256:
+            return "p256";
+        case key_type::ED25519:
+            return "ed25519";
+        case key_type::RSA2048:
+            return "rsa2048";
+    }
+    return "unknown";
+}
+
+EVP_PKEY* cert_store::generate_key(key_type type) {
+    EVP_PKEY* key = nullptr;
+    const int id = type == key_type::ED25519 ? EVP_PKEY_ED25519 : type == key_type::RSA2048 ? EVP_PKEY_RSA : EVP_PKEY_EC;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(id, nullptr);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    bool ok = EVP_PKEY_keygen_init(ctx) > 0;
+    if (ok && type == key_type::P256) {
+        ok = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0;
+    } else if (ok && type == key_type::RSA2048) {
+        ok = EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0;
+    }
+    if (!ok || EVP_PKEY_keygen(ctx, &key) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+const EVP_MD* cert_store::sign_digest(EVP_PKEY* key) {
+    // EdDSA hashes the message itself
+    return EVP_PKEY_id(key) == EVP_PKEY_ED25519 ? nullptr : EVP_sha256();
+}
+
+bool cert_store::key_has_type(EVP_PKEY* key, key_type type) {
+    switch (type) {
+        case key_type::P256:
+            return EVP_PKEY_id(key) == EVP_PKEY_EC;
+        case key_type::ED25519:
+            return EVP_PKEY_id(key) == EVP_PKEY_ED25519;
+        case key_type::RSA2048:
+            return EVP_PKEY_id(key) == EVP_PKEY_RSA;
+    }
+    return false;
+}
+
+void cert_store::set_key_type(key_type type) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    key_type_ = type;
 }
 
 std::string cert_store::get_ca_dir() const {
@@ -35,29 +113,75 @@ std::string cert_store::get_ca_key_path() const {
     return "/etc/ssl/webcm/mitm-ca.key";
 }
 
+std::string cert_store::get_leaf_key_path() const {
+    return "/etc/ssl/webcm/leaf.key";
+}
+
+std::string cert_store::get_hosts_dir() const {
+    return "/etc/ssl/webcm/hosts";
+}
+
+// Hostnames come from the SNI extension, only plain DNS names are used as file names
+static bool is_safe_hostname(const std::string& hostname) {
+    if (hostname.empty() || hostname.size() > 253 || hostname[0] == '.') {
+        return false;
+    }
+    for (char c : hostname) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+cert_store::~cert_store() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    prewarm_ready_.notify_all();
+    if (prewarm_thread_.joinable()) {
+        prewarm_thread_.join();
+    }
+}
+
 bool cert_store::ensure_ca() {
     std::lock_guard<std::mutex> lock(mutex_);
-    
+    return ensure_ca_locked();
+}
+
+bool cert_store::ensure_ca_locked() {
     if (ca_loaded_) {
         return true;
     }
 
-    // Try to load existing CA
+    // Try to load existing CA, create new CA if loading failed
     bool ca_existed = load_ca();
-    if (ca_existed) {
-        ca_loaded_ = true;
-        install_ca_to_trust_store();
-        return true;
+    if (!ca_existed && !(create_ca() && save_ca())) {
+        return false;
     }
 
-    // Create new CA if loading failed
-    if (create_ca() && save_ca()) {
-        ca_loaded_ = true;
-        install_ca_to_trust_store();
-        return true;
+    // One leaf key is reused by all host certificates, so issuing one costs a single signature.
+    // Certificates saved for a previous key or CA are not usable anymore.
+    if (!ca_existed || !load_leaf_key() || !key_has_type(leaf_key_.get(), key_type_)) {
+        leaf_key_.reset(generate_key(key_type_));
+        if (!leaf_key_) {
+            return false;
+        }
+        remove_host_certs();
+        save_leaf_key();
     }
 
-    return false;
+    // P-256 keys sign through the host when it can, loading and saving keys is not affected
+    for (auto* key : {&ca_key_, &leaf_key_}) {
+        if (EVP_PKEY* offloaded = sign_offload_wrap(key->get())) {
+            key->reset(offloaded);
+        }
+    }
+
+    ca_loaded_ = true;
+    install_ca_to_trust_store();
+    return true;
 }
 
 bool cert_store::load_ca() {
@@ -104,26 +228,11 @@ bool cert_store::load_ca() {
 
 bool cert_store::create_ca() {
     // Generate CA private key
-    EVP_PKEY* key = EVP_PKEY_new();
+    EVP_PKEY* key = generate_key(key_type_);
     if (!key) {
         return false;
     }
 
-    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
-    if (!ctx) {
-        EVP_PKEY_free(key);
-        return false;
-    }
-
-    if (EVP_PKEY_keygen_init(ctx) <= 0 ||
-        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0 ||
-        EVP_PKEY_keygen(ctx, &key) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
-        EVP_PKEY_free(key);
-        return false;
-    }
-    EVP_PKEY_CTX_free(ctx);
-
     // Create CA certificate
     X509* cert = X509_new();
     if (!cert) {
@@ -174,7 +283,7 @@ bool cert_store::create_ca() {
     }
 
     // Sign the certificate
-    if (X509_sign(cert, key, EVP_sha256()) <= 0) {
+    if (X509_sign(cert, key, sign_digest(key)) <= 0) {
         X509_free(cert);
         EVP_PKEY_free(key);
         return false;
@@ -303,73 +412,248 @@ void cert_store::install_ca_to_trust_store() {
     }
 }
 
-cert_store::cert_pair cert_store::issue_for_host(const std::string& hostname) {
-    std::lock_guard<std::mutex> lock(mutex_);
+bool cert_store::load_leaf_key() {
+    BIO* key_bio = BIO_new_file(get_leaf_key_path().c_str(), "r");
+    if (!key_bio) {
+        return false;
+    }
+    EVP_PKEY* key = PEM_read_bio_PrivateKey(key_bio, nullptr, nullptr, nullptr);
+    BIO_free(key_bio);
+    if (!key) {
+        return false;
+    }
+    leaf_key_.reset(key);
+    return true;
+}
 
-    // Check cache first
-    auto it = cert_cache_.find(hostname);
-    if (it != cert_cache_.end()) {
-        // Return a copy (we need to duplicate the cert/key for OpenSSL)
-        X509* cert_dup = X509_dup(it->second.cert.get());
-        EVP_PKEY* key = it->second.key.get();
-        if (cert_dup && key && EVP_PKEY_up_ref(key)) {
-            return cert_pair(cert_dup, key);
+bool cert_store::save_leaf_key() {
+    BIO* key_bio = BIO_new_file(get_leaf_key_path().c_str(), "w");
+    if (!key_bio) {
+        return false;
+    }
+    bool key_ok = PEM_write_bio_PrivateKey(key_bio, leaf_key_.get(), nullptr, nullptr, 0, nullptr, nullptr) > 0;
+    BIO_free(key_bio);
+    return key_ok;
+}
+
+void cert_store::remove_host_certs() {
+    std::string hosts_dir = get_hosts_dir();
+    DIR* dir = opendir(hosts_dir.c_str());
+    if (!dir) {
+        return;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            unlink((hosts_dir + "/" + entry->d_name).c_str());
         }
-        if (cert_dup) X509_free(cert_dup);
     }
+    closedir(dir);
+}
 
-    // Ensure CA is loaded
-    if (!ca_loaded_ && !ensure_ca()) {
-        return cert_pair();
-    }
-
-    // Create new certificate
-    cert_pair pair = create_cert_for_host(hostname);
-    if (pair.cert && pair.key) {
-        // Cache it (increment ref count for key, duplicate cert)
-        X509* cert_dup = X509_dup(pair.cert.get());
-        EVP_PKEY* key = pair.key.get();
-        if (cert_dup && key && EVP_PKEY_up_ref(key)) {
-            cert_cache_[hostname] = cert_pair(cert_dup, key);
-        } else {
-            if (cert_dup) X509_free(cert_dup);
+std::unique_ptr<X509, decltype(&X509_free)> cert_store::load_cert_for_host(const std::string& hostname) {
+    std::unique_ptr<X509, decltype(&X509_free)> cert(nullptr, X509_free);
+    if (!is_safe_hostname(hostname)) {
+        return cert;
+    }
+    BIO* cert_bio = BIO_new_file((get_hosts_dir() + "/" + hostname + ".crt").c_str(), "r");
+    if (!cert_bio) {
+        return cert;
+    }
+    cert.reset(PEM_read_bio_X509(cert_bio, nullptr, nullptr, nullptr));
+    BIO_free(cert_bio);
+
+    // Expired certificates are issued again
+    if (cert && X509_cmp_current_time(X509_get0_notAfter(cert.get())) <= 0) {
+        cert.reset();
+    }
+    return cert;
+}
+
+void cert_store::save_cert_for_host(const std::string& hostname, X509* cert) {
+    if (!is_safe_hostname(hostname)) {
+        return;
+    }
+    std::string hosts_dir = get_hosts_dir();
+    if (mkdir(hosts_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+
+    // Write to a temporary file first, so a partial certificate is never loaded
+    std::string cert_path = hosts_dir + "/" + hostname + ".crt";
+    std::string tmp_path = cert_path + ".tmp";
+    BIO* cert_bio = BIO_new_file(tmp_path.c_str(), "w");
+    if (!cert_bio) {
+        return;
+    }
+    bool cert_ok = PEM_write_bio_X509(cert_bio, cert) > 0;
+    BIO_free(cert_bio);
+    if (!cert_ok || rename(tmp_path.c_str(), cert_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
+
+// Call the callbacks waiting on a host, taken out of the store so they run without holding its lock
+template <typename Node>
+static void call_waiting(Node& waiting) {
+    if (!waiting.empty()) {
+        for (auto& ready : waiting.mapped()) {
+            ready();
         }
     }
+}
+
+SSL_CTX* cert_store::context_for_host(const std::string& hostname) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Check cache first
+    auto it = context_cache_.find(hostname);
+    if (it != context_cache_.end()) {
+        return it->second.get();
+    }
 
-    return pair;
+    // Ensure CA is loaded
+    if (!ca_loaded_ && !ensure_ca_locked()) {
+        auto waiting = waiting_.extract(hostname);
+        lock.unlock();
+        call_waiting(waiting);
+        return nullptr;
+    }
+
+    // Issue without holding the lock, so other hosts are served meanwhile. Handshakes wait for the helper thread
+    // through context_ready before calling this on the io thread, and never block on it here: one racing with an
+    // issuance that started meanwhile issues the host too, without saving it, and whichever finishes first is cached.
+    const bool first = issuing_.insert(hostname).second;
+    lock.unlock();
+    auto ctx = load_or_issue_context(hostname, first);
+    lock.lock();
+    SSL_CTX* result = nullptr;
+    if (ctx) {
+        result = context_cache_.emplace(hostname, std::move(ctx)).first->second.get();
+    } else {
+        it = context_cache_.find(hostname);
+        result = it != context_cache_.end() ? it->second.get() : nullptr;
+    }
+    if (!first) {
+        return result;
+    }
+    issuing_.erase(hostname);
+    auto waiting = waiting_.extract(hostname);
+    lock.unlock();
+    call_waiting(waiting);
+    return result;
 }
 
-cert_store::cert_pair cert_store::create_cert_for_host(const std::string& hostname) {
-    if (!ca_cert_ || !ca_key_) {
-        return cert_pair();
+bool cert_store::context_ready(const std::string& hostname, std::function<void()> ready) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || context_cache_.contains(hostname)) {
+        return true;
+    }
+    waiting_[hostname].push_back(std::move(ready));
+    if (issuing_.contains(hostname)) {
+        return false;
     }
 
-    // Generate leaf private key
-    EVP_PKEY* key = EVP_PKEY_new();
-    if (!key) {
-        return cert_pair();
+    // A handshake waits on it, so it goes ahead of hosts only prewarmed, even past the queue bound
+    auto queued = std::find(prewarm_queue_.begin(), prewarm_queue_.end(), hostname);
+    if (queued != prewarm_queue_.end()) {
+        prewarm_queue_.erase(queued);
+    }
+    start_prewarm_thread();
+    prewarm_queue_.push_front(hostname);
+    prewarm_ready_.notify_one();
+    return false;
+}
+
+void cert_store::prewarm(const std::string& hostname) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || context_cache_.contains(hostname) || issuing_.contains(hostname) ||
+        prewarm_queue_.size() >= PREWARM_QUEUE_MAX ||
+        std::find(prewarm_queue_.begin(), prewarm_queue_.end(), hostname) != prewarm_queue_.end()) {
+        return;
+    }
+    start_prewarm_thread();
+    prewarm_queue_.push_back(hostname);
+    prewarm_ready_.notify_one();
+}
+
+void cert_store::start_prewarm_thread() {
+    if (!prewarm_thread_.joinable()) {
+        prewarm_thread_ = std::thread(&cert_store::prewarm_loop, this);
+    }
+}
+
+void cert_store::prewarm_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        prewarm_ready_.wait(lock, [this] { return stopping_ || !prewarm_queue_.empty(); });
+        if (stopping_) {
+            return;
+        }
+        std::string hostname = std::move(prewarm_queue_.front());
+        prewarm_queue_.pop_front();
+        lock.unlock();
+        context_for_host(hostname);
+        lock.lock();
     }
+}
 
-    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> cert_store::load_or_issue_context(const std::string& hostname, bool save) {
+    // Load a certificate saved earlier, a mismatching key fails the context creation
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> ctx(nullptr, SSL_CTX_free);
+    auto cert = load_cert_for_host(hostname);
+    if (cert) {
+        ctx = create_context(hostname, cert.get());
+    }
+
+    // Otherwise create new certificate and save it, then the context serving it.
+    // Only one of concurrent issuances of a host saves, so they never write the same file.
     if (!ctx) {
-        EVP_PKEY_free(key);
-        return cert_pair();
+        cert = create_cert_for_host(hostname);
+        if (!cert) {
+            return ctx;
+        }
+        ctx = create_context(hostname, cert.get());
+        if (ctx && save) {
+            save_cert_for_host(hostname, cert.get());
+        }
     }
+    return ctx;
+}
 
-    if (EVP_PKEY_keygen_init(ctx) <= 0 ||
-        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0 ||
-        EVP_PKEY_keygen(ctx, &key) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
-        EVP_PKEY_free(key);
-        return cert_pair();
+std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> cert_store::create_context(const std::string& hostname, X509* cert) {
+    // Only the certificate and session id context are taken from this context when the ClientHello callback
+    // switches it in, sessions, tickets and protocol settings stay with the listening one
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> ctx(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+    if (!ctx) {
+        return ctx;
+    }
+    if (SSL_CTX_use_certificate(ctx.get(), cert) != 1 ||
+        SSL_CTX_use_PrivateKey(ctx.get(), leaf_key_.get()) != 1) {
+        ctx.reset();
+        return ctx;
+    }
+
+    // Sessions and tickets only resume for the host they were issued for. This relies on the context being
+    // switched in before the session lookup, which the servername callback runs after.
+    unsigned char sid_ctx[EVP_MAX_MD_SIZE];
+    unsigned int sid_ctx_length = 0;
+    if (EVP_Digest(hostname.data(), hostname.size(), sid_ctx, &sid_ctx_length, EVP_sha256(), nullptr) != 1 ||
+        SSL_CTX_set_session_id_context(ctx.get(), sid_ctx, std::min<unsigned int>(sid_ctx_length, SSL_MAX_SID_CTX_LENGTH)) != 1) {
+        ctx.reset();
+    }
+    return ctx;
+}
+
+std::unique_ptr<X509, decltype(&X509_free)> cert_store::create_cert_for_host(const std::string& hostname) {
+    std::unique_ptr<X509, decltype(&X509_free)> none(nullptr, X509_free);
+    if (!ca_cert_ || !ca_key_ || !leaf_key_) {
+        return none;
     }
-    EVP_PKEY_CTX_free(ctx);
 
     // Create certificate
     X509* cert = X509_new();
     if (!cert) {
-        EVP_PKEY_free(key);
-        return cert_pair();
+        return none;
     }
 
     // Set version
@@ -379,21 +663,18 @@ cert_store::cert_pair cert_store::create_cert_for_host(const std::string& hostna
     unsigned char serial_bytes[20];
     if (RAND_bytes(serial_bytes, sizeof(serial_bytes)) <= 0) {
         X509_free(cert);
-        EVP_PKEY_free(key);
-        return cert_pair();
+        return none;
     }
     BIGNUM* bn = BN_bin2bn(serial_bytes, sizeof(serial_bytes), nullptr);
     if (!bn) {
         X509_free(cert);
-        EVP_PKEY_free(key);
-        return cert_pair();
+        return none;
     }
     ASN1_INTEGER* serial = ASN1_INTEGER_new();
     if (!serial) {
         BN_free(bn);
         X509_free(cert);
-        EVP_PKEY_free(key);
-        return cert_pair();
+        return none;
     }
     BN_to_ASN1_INTEGER(bn, serial);
     BN_free(bn);
@@ -419,7 +700,7 @@ cert_store::cert_pair cert_store::create_cert_for_host(const std::string& hostna
     X509_set_issuer_name(cert, X509_get_subject_name(ca_cert_.get()));
 
     // Set public key
-    X509_set_pubkey(cert, key);
+    X509_set_pubkey(cert, leaf_key_.get());
 
     // Add subject alternative name extension
     STACK_OF(GENERAL_NAME)* san_list = sk_GENERAL_NAME_new_null();
@@ -446,12 +727,11 @@ cert_store::cert_pair cert_store::create_cert_for_host(const std::string& hostna
     }
 
     // Sign the certificate with CA
-    if (X509_sign(cert, ca_key_.get(), EVP_sha256()) <= 0) {
+    if (X509_sign(cert, ca_key_.get(), sign_digest(ca_key_.get())) <= 0) {
         X509_free(cert);
-        EVP_PKEY_free(key);
-        return cert_pair();
+        return none;
     }
 
-    return cert_pair(cert, key);
+    return std::unique_ptr<X509, decltype(&X509_free)>(cert, X509_free);
 }
 
@@ -5,51 +5,103 @@
 #include <openssl/x509.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <vector>
 
 class cert_store {
 public:
-    struct cert_pair {
-        std::unique_ptr<X509, decltype(&X509_free)> cert;
-        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key;
-
-        cert_pair() : cert(nullptr, X509_free), key(nullptr, EVP_PKEY_free) {}
-        cert_pair(X509* c, EVP_PKEY* k) : cert(c, X509_free), key(k, EVP_PKEY_free) {}
+    // Key algorithms for the CA and host certificates, signing with them is the main handshake cost
+    enum class key_type {
+        P256,
+        ED25519,
+        RSA2048,
     };
 
+    static bool parse_key_type(std::string_view name, key_type& out);
+    static const char* key_type_name(key_type type);
+    static EVP_PKEY* generate_key(key_type type);
+    static const EVP_MD* sign_digest(EVP_PKEY* key);
+    static bool key_has_type(EVP_PKEY* key, key_type type);
+
     static cert_store& instance();
 
-    // Ensure the root CA exists (load or create)
+    // Select the key algorithm, before the CA is loaded. An existing CA is kept,
+    // a saved leaf key of another algorithm is replaced.
+    void set_key_type(key_type type);
+
+    // Ensure the root CA exists (load or create), along with the key shared by all host certificates
     bool ensure_ca();
 
-    // Issue a certificate for a specific hostname
-    cert_pair issue_for_host(const std::string& hostname);
+    // Return an SSL context serving a certificate for a specific hostname, owned by the store.
+    // The certificate is loaded from disk or issued and saved on first use, later calls are a lookup.
+    // Never waits for an issuance of the same host in progress on another thread, but issues it again,
+    // handshakes wait for it with context_ready first.
+    SSL_CTX* context_for_host(const std::string& hostname);
+
+    // Return true when the context of a hostname is ready, so context_for_host is a lookup. Otherwise have
+    // the helper thread issue it next, unless already in progress, and call ready from the issuing thread
+    // once it is done or failed.
+    bool context_ready(const std::string& hostname, std::function<void()> ready);
+
+    // Issue the certificate of a hostname on a helper thread, so a later handshake finds it ready
+    void prewarm(const std::string& hostname);
 
 private:
     cert_store();
-    ~cert_store() = default;
+    ~cert_store();
     cert_store(const cert_store&) = delete;
     cert_store& operator=(const cert_store&) = delete;
 
     std::string get_ca_dir() const;
     std::string get_ca_cert_path() const;
     std::string get_ca_key_path() const;
+    std::string get_leaf_key_path() const;
+    std::string get_hosts_dir() const;
 
+    bool ensure_ca_locked();
     bool load_ca();
     bool create_ca();
     bool save_ca();
     void install_ca_to_trust_store();
 
-    cert_pair create_cert_for_host(const std::string& hostname);
+    bool load_leaf_key();
+    bool save_leaf_key();
+    void remove_host_certs();
+    std::unique_ptr<X509, decltype(&X509_free)> load_cert_for_host(const std::string& hostname);
+    void save_cert_for_host(const std::string& hostname, X509* cert);
+
+    std::unique_ptr<X509, decltype(&X509_free)> create_cert_for_host(const std::string& hostname);
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> load_or_issue_context(const std::string& hostname, bool save);
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> create_context(const std::string& hostname, X509* cert);
 
     std::unique_ptr<X509, decltype(&X509_free)> ca_cert_;
     std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> ca_key_;
-    std::unordered_map<std::string, cert_pair> cert_cache_;
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> leaf_key_; // Signing a certificate is cheaper than a key generation
+    std::unordered_map<std::string, std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)>> context_cache_;
+    std::unordered_set<std::string> issuing_; // Hosts being issued and saved
+    std::unordered_map<std::string, std::vector<std::function<void()>>> waiting_; // Called once the host is issued
     std::mutex mutex_;
     bool ca_loaded_;
+    key_type key_type_;
+
+    // Hosts waiting for background issuance, bounded so a burst of DNS queries can not pile up work
+    static constexpr size_t PREWARM_QUEUE_MAX = 64;
+    void start_prewarm_thread();
+    void prewarm_loop();
+    std::deque<std::string> prewarm_queue_;
+    std::condition_variable prewarm_ready_;
+    std::thread prewarm_thread_;
+    bool stopping_;
 };
 
 #endif // CERT_STORE_HPP
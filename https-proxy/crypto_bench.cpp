@@ -0,0 +1,260 @@
+#include "crypto_bench.hpp"
+#include "cert_store.hpp"
+#include "record_offload.hpp"
+#include "sign_offload.hpp"
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" uint64_t rdcycle();
+
+static constexpr int HANDSHAKE_ROUNDS = 3;
+static constexpr size_t BULK_BYTES = 1024 * 1024;
+static constexpr size_t BULK_CHUNK = 16384; // One TLS record
+static constexpr size_t BIO_PAIR_SIZE = 65536;
+
+static constexpr std::array<cert_store::key_type, 3> KEY_TYPES = {
+    cert_store::key_type::P256,
+    cert_store::key_type::ED25519,
+    cert_store::key_type::RSA2048,
+};
+static constexpr std::array<const char*, 2> GROUPS = {"X25519", "P-256"};
+static constexpr std::array<const char*, 3> CIPHERSUITES = {
+    "TLS_AES_128_GCM_SHA256",
+    "TLS_AES_256_GCM_SHA384",
+    "TLS_CHACHA20_POLY1305_SHA256",
+};
+
+using ssl_ctx_ptr = std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)>;
+using ssl_ptr = std::unique_ptr<SSL, decltype(&SSL_free)>;
+
+// Self-signed certificate for the key, the client does not verify it
+static std::unique_ptr<X509, decltype(&X509_free)> make_cert(EVP_PKEY* key) {
+    std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), X509_free);
+    if (!cert) {
+        return cert;
+    }
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+    X509_gmtime_adj(X509_get_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert.get()), 86400L);
+    X509_NAME* name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("bench"), -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+    X509_set_pubkey(cert.get(), key);
+    if (X509_sign(cert.get(), key, cert_store::sign_digest(key)) <= 0) {
+        cert.reset();
+    }
+    return cert;
+}
+
+// TLS 1.3 only with one group and cipher suite, no session resumption, so every handshake is a full one
+static ssl_ctx_ptr make_context(bool server, EVP_PKEY* key, X509* cert, const char* group, const char* ciphersuite) {
+    ssl_ctx_ptr ctx(SSL_CTX_new(server ? TLS_server_method() : TLS_client_method()), SSL_CTX_free);
+    if (!ctx) {
+        return ctx;
+    }
+    bool ok = SSL_CTX_set_min_proto_version(ctx.get(), TLS1_3_VERSION) == 1 &&
+        SSL_CTX_set_max_proto_version(ctx.get(), TLS1_3_VERSION) == 1 &&
+        SSL_CTX_set1_groups_list(ctx.get(), group) == 1 &&
+        SSL_CTX_set_ciphersuites(ctx.get(), ciphersuite) == 1;
+    SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx.get(), SSL_OP_NO_TICKET);
+    if (server) {
+        ok = ok && SSL_CTX_use_certificate(ctx.get(), cert) == 1 && SSL_CTX_use_PrivateKey(ctx.get(), key) == 1;
+    } else {
+        SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_NONE, nullptr);
+    }
+    if (!ok) {
+        ctx.reset();
+    }
+    return ctx;
+}
+
+// A connected pair of endpoints over an in-memory BIO pair
+struct tls_pair final {
+    ssl_ptr server{nullptr, SSL_free};
+    ssl_ptr client{nullptr, SSL_free};
+
+    bool open(SSL_CTX* server_ctx, SSL_CTX* client_ctx) {
+        server.reset(SSL_new(server_ctx));
+        client.reset(SSL_new(client_ctx));
+        BIO* server_bio = nullptr;
+        BIO* client_bio = nullptr;
+        if (!server || !client || BIO_new_bio_pair(&server_bio, BIO_PAIR_SIZE, &client_bio, BIO_PAIR_SIZE) != 1) {
+            return false;
+        }
+        SSL_set_bio(server.get(), server_bio, server_bio);
+        SSL_set_bio(client.get(), client_bio, client_bio);
+        SSL_set_accept_state(server.get());
+        SSL_set_connect_state(client.get());
+        return true;
+    }
+
+    bool handshake() {
+        for (int i = 0; i < 32; ++i) {
+            const int client_rc = SSL_do_handshake(client.get());
+            const int server_rc = SSL_do_handshake(server.get());
+            if (client_rc == 1 && server_rc == 1) {
+                return true;
+            }
+            if ((client_rc != 1 && !would_block(client.get(), client_rc)) ||
+                (server_rc != 1 && !would_block(server.get(), server_rc))) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Send bytes from the server, as the proxy does with response bodies, and read them on the client.
+    // served counts the cycles of the server alone.
+    bool transfer(size_t bytes, uint64_t &served) {
+        std::vector<char> chunk(BULK_CHUNK, 'x');
+        std::vector<char> sink(BULK_CHUNK);
+        size_t sent = 0;
+        size_t received = 0;
+        while (received < bytes) {
+            if (sent < bytes) {
+                const uint64_t start = rdcycle();
+                const int n = SSL_write(server.get(), chunk.data(), static_cast<int>(std::min(BULK_CHUNK, bytes - sent)));
+                served += rdcycle() - start;
+                if (n > 0) {
+                    sent += n;
+                } else if (!would_block(server.get(), n)) {
+                    return false;
+                }
+            }
+            int n = 0;
+            while ((n = SSL_read(client.get(), sink.data(), static_cast<int>(sink.size()))) > 0) {
+                received += n;
+            }
+            if (!would_block(client.get(), n)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool would_block(SSL* ssl, int rc) {
+        const int err = SSL_get_error(ssl, rc);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+    }
+};
+
+int run_crypto_bench() {
+    uint64_t best_handshake = std::numeric_limits<uint64_t>::max();
+    cert_store::key_type best_key = cert_store::key_type::P256;
+    const char* best_group = GROUPS[0];
+    uint64_t ed25519_handshake = std::numeric_limits<uint64_t>::max();
+    uint64_t offload_handshake = std::numeric_limits<uint64_t>::max();
+
+    // Handshakes, the cipher suite barely matters for them.
+    // P-256 runs twice, the second time with signatures offloaded to the host.
+    for (size_t run = 0; run <= KEY_TYPES.size(); ++run) {
+        const cert_store::key_type type = run < KEY_TYPES.size() ? KEY_TYPES[run] : cert_store::key_type::P256;
+        const bool offload = run == KEY_TYPES.size();
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(cert_store::generate_key(type), EVP_PKEY_free);
+        if (key && offload) {
+            key.reset(sign_offload_wrap(key.get()));
+        }
+        auto cert = key ? make_cert(key.get()) : std::unique_ptr<X509, decltype(&X509_free)>(nullptr, X509_free);
+        const std::string name = std::string(cert_store::key_type_name(type)) + (offload ? "+offload" : "");
+        if (!cert) {
+            printf("%-15s key generation failed\n", name.c_str());
+            continue;
+        }
+        for (const char* group : GROUPS) {
+            ssl_ctx_ptr server_ctx = make_context(true, key.get(), cert.get(), group, CIPHERSUITES[2]);
+            ssl_ctx_ptr client_ctx = make_context(false, nullptr, nullptr, group, CIPHERSUITES[2]);
+            uint64_t cycles = 0;
+            bool ok = server_ctx && client_ctx;
+            for (int i = 0; ok && i < HANDSHAKE_ROUNDS; ++i) {
+                tls_pair pair;
+                ok = pair.open(server_ctx.get(), client_ctx.get());
+                const uint64_t start = rdcycle();
+                ok = ok && pair.handshake();
+                cycles += rdcycle() - start;
+            }
+            if (!ok) {
+                printf("%-15s %-7s handshake failed\n", name.c_str(), group);
+                ERR_clear_error();
+                continue;
+            }
+            cycles /= HANDSHAKE_ROUNDS;
+            printf("%-15s %-7s handshake %12llu cycles\n", name.c_str(), group,
+                static_cast<unsigned long long>(cycles));
+            if (cycles < best_handshake) {
+                best_handshake = cycles;
+                best_key = type;
+                best_group = group;
+            }
+            uint64_t& compared = offload ? offload_handshake : ed25519_handshake;
+            if ((offload || type == cert_store::key_type::ED25519) && cycles < compared) {
+                compared = cycles;
+            }
+        }
+    }
+    // The default certificate with offload against the cheapest to sign in the guest
+    if (offload_handshake != std::numeric_limits<uint64_t>::max() &&
+        ed25519_handshake != std::numeric_limits<uint64_t>::max()) {
+        printf("%-15s %-7s handshake %12.2f x ed25519\n", "p256+offload", "best",
+            static_cast<double>(offload_handshake) / static_cast<double>(ed25519_handshake));
+    }
+
+    // Bulk transfers over connections of the cheapest handshake, then AES-GCM again with records encrypted
+    // by the host. Contexts created once offload is enabled all use it, so it comes last.
+    uint64_t best_bulk = std::numeric_limits<uint64_t>::max();
+    const char* best_ciphersuite = CIPHERSUITES[2];
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(cert_store::generate_key(best_key), EVP_PKEY_free);
+    auto cert = key ? make_cert(key.get()) : std::unique_ptr<X509, decltype(&X509_free)>(nullptr, X509_free);
+    for (size_t run = 0; run < CIPHERSUITES.size() * 2; ++run) {
+        const char* ciphersuite = CIPHERSUITES[run % CIPHERSUITES.size()];
+        const bool offload = run >= CIPHERSUITES.size();
+        const std::string name = std::string(ciphersuite) + (offload ? "+offload" : "");
+        if (offload && (!std::string_view(ciphersuite).starts_with("TLS_AES_") || !record_offload_enable())) {
+            continue;
+        }
+        ssl_ctx_ptr server_ctx = make_context(true, key.get(), cert.get(), best_group, ciphersuite);
+        ssl_ctx_ptr client_ctx = make_context(false, nullptr, nullptr, best_group, ciphersuite);
+        tls_pair pair;
+        if (!cert || !server_ctx || !client_ctx || !pair.open(server_ctx.get(), client_ctx.get()) || !pair.handshake()) {
+            printf("%-30s handshake failed\n", name.c_str());
+            ERR_clear_error();
+            continue;
+        }
+        uint64_t served = 0;
+        const uint64_t start = rdcycle();
+        const bool ok = pair.transfer(BULK_BYTES, served);
+        const uint64_t cycles = rdcycle() - start;
+        if (!ok) {
+            printf("%-30s transfer failed\n", name.c_str());
+            ERR_clear_error();
+            continue;
+        }
+        printf("%-30s %12llu cycles/MiB, %12llu served\n", name.c_str(), static_cast<unsigned long long>(cycles),
+            static_cast<unsigned long long>(served));
+        if (cycles < best_bulk) {
+            best_bulk = cycles;
+            best_ciphersuite = ciphersuite;
+        }
+    }
+
+    if (best_handshake == std::numeric_limits<uint64_t>::max()) {
+        return EXIT_FAILURE;
+    }
+    printf("cheapest: --key=%s --groups=%s --ciphersuites=%s\n", cert_store::key_type_name(best_key), best_group,
+        best_ciphersuite);
+    return EXIT_SUCCESS;
+}
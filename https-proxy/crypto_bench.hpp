@@ -0,0 +1,10 @@
+#ifndef CRYPTO_BENCH_HPP
+#define CRYPTO_BENCH_HPP
+
+// Measure guest cycles of TLS handshakes and bulk transfers for each key algorithm, key exchange group
+// and cipher suite, with both ends in memory, then print the cheapest combination as proxy options.
+// Both ends count, as clients in the guest pay for their half of the protocol too. Bulk transfers also
+// report the cycles of the serving end alone, with and without records encrypted by the host.
+int run_crypto_bench();
+
+#endif // CRYPTO_BENCH_HPP
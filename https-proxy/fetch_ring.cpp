@@ -0,0 +1,193 @@
+#include "fetch_ring.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+static uint64_t round_to_block(uint64_t length) {
+    return (length + RING_BLOCK_SIZE - 1) & ~(RING_BLOCK_SIZE - 1);
+}
+
+fetch_ring& fetch_ring::instance() {
+    static fetch_ring ring;
+    return ring;
+}
+
+fetch_ring::fetch_ring()
+    : fd_(-1)
+    , slot_(static_cast<char*>(aligned_alloc(RING_BLOCK_SIZE, RING_SLOT_SIZE)), free)
+    , block_(static_cast<char*>(aligned_alloc(RING_BLOCK_SIZE, RING_BLOCK_SIZE)), free) {
+}
+
+bool fetch_ring::open(const char* path) {
+    fd_ = ::open(path, O_RDWR | O_DIRECT);
+    if (fd_ < 0) {
+        std::cerr << "Failed to open fetch ring " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    // Continue from the host indices, so the host never sees the guest side go backwards
+    ring_ctl host_ctl;
+    if (!read_host_ctl(host_ctl)) {
+        return false;
+    }
+    ctl_.sq_index = host_ctl.sq_index;
+    ctl_.cq_index = host_ctl.cq_index;
+    host_sq_index_ = host_ctl.sq_index;
+    return write_ctl();
+}
+
+bool fetch_ring::read_host_ctl(ring_ctl& ctl) {
+    if (pread(fd_, block_.get(), RING_BLOCK_SIZE, RING_HOST_CTL_OFFSET) != static_cast<ssize_t>(RING_BLOCK_SIZE)) {
+        std::cerr << "Failed to read fetch ring: " << strerror(errno) << "\n";
+        return false;
+    }
+    memcpy(&ctl, block_.get(), sizeof(ctl));
+    return true;
+}
+
+bool fetch_ring::write_ctl() {
+    memset(block_.get(), 0, RING_BLOCK_SIZE);
+    memcpy(block_.get(), &ctl_, sizeof(ctl_));
+    if (pwrite(fd_, block_.get(), RING_BLOCK_SIZE, RING_GUEST_CTL_OFFSET) != static_cast<ssize_t>(RING_BLOCK_SIZE)) {
+        std::cerr << "Failed to write fetch ring: " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool fetch_ring::submit(ring_op op, uint64_t uid, std::string_view payload) {
+    if (payload.length() > RING_PAYLOAD_MAX) {
+        return false;
+    }
+
+    // Queue behind earlier submissions still waiting, or when the host has not freed a slot yet.
+    // The host head is only read again once the last known one says the queue is full.
+    if (backlog_.empty() && ctl_.sq_index - host_sq_index_ >= RING_ENTRIES) {
+        ring_ctl host_ctl;
+        if (!read_host_ctl(host_ctl)) {
+            return false;
+        }
+        host_sq_index_ = host_ctl.sq_index;
+    }
+    if (!backlog_.empty() || ctl_.sq_index - host_sq_index_ >= RING_ENTRIES) {
+        backlog_.push_back(submission{op, uid, std::string(payload)});
+        return true;
+    }
+    return write_entry(op, uid, payload) && write_ctl();
+}
+
+// Write an entry into the next slot, it is published by the next write_ctl()
+bool fetch_ring::write_entry(ring_op op, uint64_t uid, std::string_view payload) {
+    ring_entry entry;
+    entry.op = static_cast<uint32_t>(op);
+    entry.uid = uid;
+    entry.length = payload.length();
+    memcpy(slot_.get(), &entry, sizeof(entry));
+    memcpy(slot_.get() + sizeof(entry), payload.data(), payload.length());
+    const uint64_t length = round_to_block(sizeof(entry) + payload.length());
+    const uint64_t offset = RING_SQ_OFFSET + (ctl_.sq_index % RING_ENTRIES) * RING_SLOT_SIZE;
+    if (pwrite(fd_, slot_.get(), length, offset) != static_cast<ssize_t>(length)) {
+        std::cerr << "Failed to write fetch ring: " << strerror(errno) << "\n";
+        return false;
+    }
+    ctl_.sq_index++;
+    return true;
+}
+
+bool fetch_ring::reap_completion(completion& out) {
+    // Read the first block, then the rest of the payload when it does not fit
+    const uint64_t offset = RING_CQ_OFFSET + (ctl_.cq_index % RING_ENTRIES) * RING_SLOT_SIZE;
+    if (pread(fd_, slot_.get(), RING_BLOCK_SIZE, offset) != static_cast<ssize_t>(RING_BLOCK_SIZE)) {
+        std::cerr << "Failed to read fetch ring: " << strerror(errno) << "\n";
+        return false;
+    }
+    memcpy(&out.entry, slot_.get(), sizeof(out.entry));
+    if (out.entry.length > RING_PAYLOAD_MAX) {
+        std::cerr << "Malformed fetch ring completion\n";
+        return false;
+    }
+    const uint64_t length = round_to_block(sizeof(out.entry) + out.entry.length);
+    if (length > RING_BLOCK_SIZE &&
+        pread(fd_, slot_.get() + RING_BLOCK_SIZE, length - RING_BLOCK_SIZE, offset + RING_BLOCK_SIZE) !=
+            static_cast<ssize_t>(length - RING_BLOCK_SIZE)) {
+        std::cerr << "Failed to read fetch ring: " << strerror(errno) << "\n";
+        return false;
+    }
+    out.payload.assign(slot_.get() + sizeof(out.entry), out.entry.length);
+    ctl_.cq_index++;
+    return write_ctl();
+}
+
+void fetch_ring::async_wait(uint64_t uid, handler h) {
+    waiters_[uid] = std::move(h);
+}
+
+void fetch_ring::forget(uint64_t uid, uint64_t count) {
+    if (count > 0) {
+        forgotten_[uid] += count; // Dropped by poll(), including the ones already reaped
+    }
+}
+
+bool fetch_ring::poll() {
+    ring_ctl host_ctl;
+    bool ok = read_host_ctl(host_ctl);
+
+    // Post queued submissions into the slots the host freed, published together
+    bool progress = false;
+    if (ok) {
+        host_sq_index_ = host_ctl.sq_index;
+        while (ok && !backlog_.empty() && ctl_.sq_index - host_sq_index_ < RING_ENTRIES) {
+            const submission& sub = backlog_.front();
+            ok = write_entry(sub.op, sub.uid, sub.payload);
+            backlog_.pop_front();
+            progress = true;
+        }
+        ok = ok && (!progress || write_ctl());
+    }
+
+    // Reap everything the host posted, a broken ring fails all waiters
+    while (ok && ctl_.cq_index != host_ctl.cq_index) {
+        completion c;
+        ok = reap_completion(c);
+        if (ok) {
+            pending_.push_back(std::move(c));
+        }
+    }
+    if (!ok) {
+        backlog_.clear();
+        auto waiters = std::move(waiters_);
+        waiters_.clear();
+        for (auto& [uid, h] : waiters) {
+            h(false, completion{});
+        }
+        return true;
+    }
+
+    // Dispatch in posting order, handlers may wait again on the same fetch
+    bool dispatched = progress;
+    for (auto it = pending_.begin(); it != pending_.end();) {
+        const uint64_t uid = it->entry.uid;
+        const auto forgotten = forgotten_.find(uid);
+        if (forgotten != forgotten_.end()) {
+            it = pending_.erase(it);
+            if (--forgotten->second == 0) {
+                forgotten_.erase(forgotten);
+            }
+            continue;
+        }
+        const auto waiter = waiters_.find(uid);
+        if (waiter == waiters_.end()) {
+            ++it;
+            continue;
+        }
+        handler h = std::move(waiter->second);
+        waiters_.erase(waiter);
+        completion c = std::move(*it);
+        it = pending_.erase(it);
+        h(true, std::move(c)); // Never touches pending_, so it stays valid
+        dispatched = true;
+    }
+    return dispatched;
+}
@@ -0,0 +1,118 @@
+#ifndef FETCH_RING_HPP
+#define FETCH_RING_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Fetch ring, a flash drive shared by guest and host for batched network operations.
+//
+// The guest posts submission entries with O_DIRECT writes to the ring drive, the host drains them
+// between run slices with physical memory accesses and posts completion entries back, so network
+// operations need neither soft yields nor page walks. Each control block is written by one side
+// only, indices are free running and wrap modulo RING_ENTRIES.
+// Layout must match webcm.cpp.
+static constexpr uint32_t RING_VERSION = 1;
+static constexpr uint64_t RING_BLOCK_SIZE = 512; // O_DIRECT granularity
+static constexpr uint64_t RING_ENTRIES = 32;
+static constexpr uint64_t RING_SLOT_SIZE = 32768;
+static constexpr uint64_t RING_GUEST_CTL_OFFSET = 0;
+static constexpr uint64_t RING_HOST_CTL_OFFSET = RING_BLOCK_SIZE;
+static constexpr uint64_t RING_SQ_OFFSET = 4096;
+static constexpr uint64_t RING_CQ_OFFSET = RING_SQ_OFFSET + RING_ENTRIES * RING_SLOT_SIZE;
+
+enum class ring_op : uint32_t {
+    NOP = 0,
+    REQUEST, // Payload is a yield_req, completes when the response headers arrive
+    REQUEST_BODY, // Payload is appended to the staged request body, no completion
+    READ_BODY, // Payload is a ring_read, completes with the next body bytes, none at the end
+    CLOSE, // Release the fetch, pending reads complete as failed
+};
+
+struct ring_ctl final {
+    uint32_t version{RING_VERSION};
+    uint32_t sq_index{0}; // Guest: submission tail, host: submission head
+    uint32_t cq_index{0}; // Guest: completion head, host: completion tail
+};
+
+struct ring_entry final {
+    uint32_t op{0};
+    uint32_t result{0}; // yield_result of a completion
+    uint64_t uid{0};
+    uint32_t length{0}; // Payload length following this header
+    uint32_t reserved{0};
+};
+
+struct ring_read final {
+    uint64_t length{0}; // Maximum bytes to return
+};
+
+static constexpr uint64_t RING_PAYLOAD_MAX = RING_SLOT_SIZE - sizeof(ring_entry);
+
+class fetch_ring {
+public:
+    struct completion {
+        ring_entry entry;
+        std::string payload;
+    };
+
+    using handler = std::function<void(bool ok, completion&& c)>;
+
+    static fetch_ring& instance();
+
+    // Attach to the ring drive, continuing from the host indices
+    bool open(const char* path);
+
+    // Post a submission, queued in memory while the submission queue is full and posted by poll()
+    // once the host frees slots, so it never blocks. Submissions are posted in order.
+    bool submit(ring_op op, uint64_t uid, std::string_view payload);
+
+    // Call handler from poll() with the next completion of a fetch, fetches complete in posting order
+    void async_wait(uint64_t uid, handler h);
+
+    // Drop the next count completions of a fetch, nobody waits for them any more
+    void forget(uint64_t uid, uint64_t count);
+
+    // Post queued submissions, reap completions and dispatch them to their waiters,
+    // returns true when any submission was posted or completion dispatched
+    bool poll();
+
+    // Whether poll() has work, completions to wait for or submissions to post
+    bool waiting() const {
+        return !waiters_.empty() || !backlog_.empty();
+    }
+
+private:
+    fetch_ring();
+    ~fetch_ring() = default;
+    fetch_ring(const fetch_ring&) = delete;
+    fetch_ring& operator=(const fetch_ring&) = delete;
+
+    struct submission {
+        ring_op op;
+        uint64_t uid;
+        std::string payload;
+    };
+
+    bool read_host_ctl(ring_ctl& ctl);
+    bool write_ctl();
+    bool write_entry(ring_op op, uint64_t uid, std::string_view payload);
+    bool reap_completion(completion& out);
+
+    int fd_;
+    ring_ctl ctl_;
+    uint32_t host_sq_index_{0}; // Host submission head when last read, slots before it are free
+    std::unique_ptr<char, decltype(&free)> slot_; // Block aligned bounce buffers for O_DIRECT
+    std::unique_ptr<char, decltype(&free)> block_;
+    std::deque<submission> backlog_; // Submissions waiting for a free slot
+    std::deque<completion> pending_; // Reaped completions nobody waits for yet
+    std::unordered_map<uint64_t, handler> waiters_;
+    std::unordered_map<uint64_t, uint64_t> forgotten_;
+};
+
+#endif // FETCH_RING_HPP
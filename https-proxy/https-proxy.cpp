@@ -14,11 +14,18 @@
 //------------------------------------------------------------------------------
 
 #include "cert_store.hpp"
+#include "crypto_bench.hpp"
+#include "fetch_ring.hpp"
+#include "record_offload.hpp"
+#include "sign_offload.hpp"
 
 #include <boost/asio/dispatch.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/read.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/ip/udp.hpp>
@@ -27,13 +34,20 @@
 #include <boost/beast/http/field.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/config.hpp>
+#include <algorithm>
 #include <array>
+#include <cctype>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -63,26 +77,84 @@ using udp = boost::asio::ip::udp; // from <boost/asio/ip/udp.hpp>
 
 enum class yield_type : uint64_t {
     INVALID = 0,
-    REQUEST,
-    POLL_RESPONSE,
-    POLL_RESPONSE_BODY,
+    REQUEST, // Retired, network operations go through the fetch ring
+    POLL_RESPONSE, // Retired
+    POLL_RESPONSE_BODY, // Retired
+    SNAPSHOT,
+    GET_TIME,
+    SHELL_READY,
+    SIGN, // a1 points to a yield_sign, see sign_offload.hpp
+    ENCRYPT, // a1 points to a yield_encrypt, see record_offload.hpp
 };
 
-struct yield_mmio_req final {
-    uint64_t headers_count{0};
-    uint64_t body_vaddr{0};
-    uint64_t body_length{0};
-    char url[4096]{};
-    char method[32]{};
-    char headers[64][2][256]{};
+// Result of a fetch ring completion
+enum class yield_result : uint32_t {
+    OK = 0,
+    FAILED,
 };
 
-struct yield_mmio_res final {
-    uint64_t ready_state{0};
-    uint64_t status{0};
-    uint64_t body_total_length{0};
-    uint64_t headers_count{0};
-    char headers[64][2][256]{};
+// Network payloads are length-prefixed records, versioned so guest and host can detect a mismatch.
+// Strings are not NUL terminated, each header is a yield_field followed by its name and value bytes.
+static constexpr uint32_t YIELD_WIRE_VERSION = 3;
+static constexpr uint64_t YIELD_INLINE_BODY_MAX = 16384; // Body bytes up to this size travel inside the payload
+
+struct yield_field final {
+    uint32_t name_length{0};
+    uint32_t value_length{0};
+};
+
+// REQUEST payload, followed by the method, url, header fields and inline body
+struct yield_req final {
+    uint32_t version{YIELD_WIRE_VERSION};
+    uint32_t length{0}; // Encoded length, including this header
+    uint32_t method_length{0};
+    uint32_t url_length{0};
+    uint32_t headers_count{0};
+    uint32_t inline_body_length{0};
+    uint64_t body_length{0}; // Body staged by REQUEST_BODY entries when too large to inline
+};
+
+// REQUEST completion payload, sent once the response headers arrive,
+// followed by the header fields and the leading body bytes already received
+struct yield_res final {
+    uint32_t version{YIELD_WIRE_VERSION};
+    uint32_t length{0}; // Encoded length, including this header
+    uint32_t headers_count{0};
+    uint32_t inline_body_length{0};
+    uint32_t status{0};
+    uint32_t body_done{0}; // Nonzero when the inline bytes are the whole body
+};
+
+// Body reads kept in flight ahead of the one being consumed
+static constexpr uint64_t RING_READ_AHEAD = 8;
+
+template <class T>
+static void append_pod(std::string &buf, const T &value) {
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(value)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+// Sequential reader over a yield payload, reads past its end fail
+struct payload_reader final {
+    std::string_view data;
+
+    bool read(std::string_view &out, size_t length) {
+        if (length > data.length()) {
+            return false;
+        }
+        out = data.substr(0, length);
+        data.remove_prefix(length);
+        return true;
+    }
+
+    template <class T>
+    bool read(T &out) {
+        std::string_view bytes;
+        if (!read(bytes, sizeof(T))) {
+            return false;
+        }
+        memcpy(&out, bytes.data(), sizeof(T));
+        return true;
+    }
 };
 
 extern "C" __attribute__((noinline, naked)) uint64_t softyield(uint64_t /*a0*/, uint64_t /*a1*/, uint64_t /*a2*/) {
@@ -98,93 +170,288 @@ extern "C" __attribute__((noinline)) uint64_t rdcycle() {
     return cycle;
 }
 
-template <size_t N>
-static void strsvcopy(char (&dest)[N], std::string_view sv) {
-    memcpy(dest, sv.data(), std::min(sv.length(), N));
-    dest[std::min(sv.length(), N - 1)] = 0;
-}
-
-template <class Body, class Allocator>
-static void fill_mmio_req(yield_mmio_req &mmio_req, const http::request<Body, http::basic_fields<Allocator>> &req) {
+// Encode a REQUEST payload, sized to the bytes actually used.
+// The body is inline, or staged_length bytes were already sent in REQUEST_BODY entries.
+static std::string encode_request(const http::request_header<> &req, std::string_view inline_body, uint64_t staged_length) {
     const std::string_view host = req["Host"];
     const std::string_view method = req.method_string();
     const std::string url = std::string("https://").append(host).append(req.target());
-    strsvcopy(mmio_req.url, url);
-    strsvcopy(mmio_req.method, method);
-    mmio_req.headers_count = 0;
+    yield_req header;
+    header.method_length = method.length();
+    header.url_length = url.length();
+    std::string fields;
     for (auto &field : req) {
         if (field.name() != http::field::user_agent && field.name() != http::field::host &&
-            field.name() != http::field::content_length) {
-            strsvcopy(mmio_req.headers[mmio_req.headers_count][0], field.name_string());
-            strsvcopy(mmio_req.headers[mmio_req.headers_count][1], field.value());
-            mmio_req.headers_count++;
-            if (mmio_req.headers_count >= 64) {
-                break;
-            }
+            field.name() != http::field::content_length && field.name() != http::field::transfer_encoding &&
+            field.name() != http::field::expect) {
+            const std::string_view name = field.name_string();
+            const std::string_view value = field.value();
+            append_pod(fields, yield_field{static_cast<uint32_t>(name.length()), static_cast<uint32_t>(value.length())});
+            fields.append(name).append(value);
+            header.headers_count++;
         }
     }
-    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-    mmio_req.body_vaddr = reinterpret_cast<uintptr_t>(req.body().c_str());
-    mmio_req.body_length = req.body().length();
+    header.inline_body_length = inline_body.length();
+    header.body_length = staged_length;
+    header.length = sizeof(header) + method.length() + url.length() + fields.length() + header.inline_body_length;
+    std::string payload;
+    payload.reserve(header.length);
+    append_pod(payload, header);
+    payload.append(method).append(url).append(fields).append(inline_body);
+    return payload;
 }
 
-// Return a response for the given request.
-//
-// The concrete type of the response message (which depends on the
-// request), is type-erased in message_generator.
-template <class Body, class Allocator>
-static http::message_generator handle_request(http::request<Body, http::basic_fields<Allocator>> &&req) {
-    auto const bad_request = [&req](beast::string_view why) {
-        http::response<http::string_body> res{http::status::bad_request, req.version()};
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, "text/plain");
-        res.keep_alive(false);
-        res.body() = std::string(why);
-        res.prepare_payload();
-        return res;
-    };
+// Return an error response for the given request.
+static http::message_generator bad_request(unsigned version, beast::string_view why) {
+    http::response<http::string_body> res{http::status::bad_request, version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/plain");
+    res.keep_alive(false);
+    res.body() = std::string(why);
+    res.prepare_payload();
+    return res;
+}
+
+// A request forwarded to the host through the fetch ring, with its response body streamed back in windows.
+// Drives fetch ring completions from the io_context, so sessions waiting on the host never block
+// each other. The ring is polled on a timer only while some fetch waits, backing off while idle.
+// Nothing interrupts the guest when a completion lands, it is seen on the next poll. When the guest
+// has nothing else to run, the emulator skips the idle time up to that poll at no host cost, otherwise
+// a completion can wait up to BACKOFF_MAX of guest time.
+class ring_poller : public std::enable_shared_from_this<ring_poller> {
+    static constexpr std::chrono::microseconds BACKOFF_MIN{1000};
+    static constexpr std::chrono::microseconds BACKOFF_MAX{8000};
+
+    net::steady_timer timer_;
+    std::chrono::microseconds backoff_{BACKOFF_MIN};
+    bool armed_{false};
+
+public:
+    explicit ring_poller(net::io_context &ioc) : timer_(ioc) {}
+
+    // Call handler with the next completion of a fetch
+    void async_wait(uint64_t uid, fetch_ring::handler handler) {
+        fetch_ring::instance().async_wait(uid, std::move(handler));
+        wake();
+    }
+
+    // Start polling when the ring has work, such as submissions queued while it was full
+    void wake() {
+        if (!armed_ && fetch_ring::instance().waiting()) {
+            backoff_ = BACKOFF_MIN;
+            arm();
+        }
+    }
+
+private:
+    void arm() {
+        armed_ = true;
+        timer_.expires_after(backoff_);
+        timer_.async_wait(beast::bind_front_handler(&ring_poller::on_timer, shared_from_this()));
+    }
+
+    void on_timer(beast::error_code ec) {
+        armed_ = false;
+        if (ec) {
+            return;
+        }
+        fetch_ring &ring = fetch_ring::instance();
+        backoff_ = ring.poll() ? BACKOFF_MIN : std::min(backoff_ * 2, BACKOFF_MAX);
+        if (ring.waiting()) {
+            arm();
+        }
+    }
+};
+
+static std::shared_ptr<ring_poller> fetch_poller; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
-    const uint64_t uid = rdcycle();
-    yield_mmio_req mmio_req;
-    fill_mmio_req(mmio_req, req);
-    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-    if (softyield(static_cast<uint64_t>(yield_type::REQUEST), uid, reinterpret_cast<uintptr_t>(&mmio_req)) != 0) {
-        return bad_request("Request yield failed");
+// A request forwarded to the host, its response is streamed back in windows.
+// Handlers are posted to the owner's executor, never called from within the initiating function.
+class upstream_fetch final {
+public:
+    using head_handler = std::function<void(bool ok, http::response_header<> &&head, std::string_view why)>;
+    using window_handler = std::function<void(bool ok)>;
+
+    explicit upstream_fetch(net::any_io_executor executor) : executor_(std::move(executor)) {}
+    upstream_fetch(const upstream_fetch &) = delete;
+    upstream_fetch &operator=(const upstream_fetch &) = delete;
+
+    ~upstream_fetch() {
+        close();
     }
 
-    yield_mmio_res mmio_res;
-    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-    if (softyield(static_cast<uint64_t>(yield_type::POLL_RESPONSE), uid, reinterpret_cast<uintptr_t>(&mmio_res)) != 0) {
-        return bad_request("Poll response headers yield failed");
+    // Stage a chunk of a request body too large to inline, before the request is submitted
+    bool stage_body(std::string_view chunk) {
+        open_ = true;
+        staged_length_ += chunk.length();
+        return fetch_ring::instance().submit(ring_op::REQUEST_BODY, uid_, chunk);
     }
 
-    std::string body;
-    if (mmio_res.body_total_length > 0) {
-        body.resize(mmio_res.body_total_length, '\x0');
-        if (softyield(static_cast<uint64_t>(yield_type::POLL_RESPONSE_BODY),
-                uid, // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-                reinterpret_cast<uintptr_t>(body.data())) != 0) {
-            return bad_request("Poll response body yield failed");
+    // Submit the request, with the rest of its body, then call handler once the response head arrives.
+    // On failure why tells the reason.
+    void async_start(const http::request_header<> &req, std::string_view body, head_handler handler) {
+        if ((staged_length_ > 0 || body.length() > YIELD_INLINE_BODY_MAX) && !body.empty() && !stage_body(body)) {
+            post_head(std::move(handler), false, {}, "Request body submission failed");
+            return;
+        }
+        const std::string req_payload = encode_request(req, staged_length_ > 0 ? std::string_view() : body, staged_length_);
+        if (req_payload.length() > RING_PAYLOAD_MAX) {
+            post_head(std::move(handler), false, {}, "Request headers too large");
+            return;
         }
-    } else if (mmio_res.status == 0) {
-        return bad_request("Fetch failed, either due to CORS policy violation or network error.");
+        open_ = true;
+        if (!fetch_ring::instance().submit(ring_op::REQUEST, uid_, req_payload)) {
+            post_head(std::move(handler), false, {}, "Request submission failed");
+            return;
+        }
+        fetch_poller->async_wait(uid_, [this, version = req.version(), handler = std::move(handler)](bool ok, fetch_ring::completion &&c) mutable {
+            http::response_header<> head;
+            const std::string_view why = on_head(ok, c, version, head);
+            post_head(std::move(handler), why.empty(), std::move(head), why);
+        });
     }
 
-    // Respond request
-    http::response<http::string_body> res{http::int_to_status(mmio_res.status), req.version()};
-    for (uint64_t i = 0; i < mmio_res.headers_count; ++i) {
-        res.set(mmio_res.headers[i][0], mmio_res.headers[i][1]);
+    // Read the next window of the response body, an empty window ends it
+    void async_read_window(std::string &window, window_handler handler) {
+        if (!window_.empty() || !open_ || eof_) {
+            window = std::move(window_);
+            window_.clear();
+            net::post(executor_, [handler = std::move(handler)] { handler(true); });
+            return;
+        }
+
+        // Keep a batch of reads in flight, the host completes them in one pass
+        fetch_ring &ring = fetch_ring::instance();
+        const ring_read read{RING_PAYLOAD_MAX};
+        while (in_flight_ < RING_READ_AHEAD) {
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+            if (!ring.submit(ring_op::READ_BODY, uid_, std::string_view(reinterpret_cast<const char *>(&read), sizeof(read)))) {
+                net::post(executor_, [handler = std::move(handler)] { handler(false); });
+                return;
+            }
+            in_flight_++;
+        }
+        fetch_poller->async_wait(uid_, [this, &window, handler = std::move(handler)](bool ok, fetch_ring::completion &&c) mutable {
+            in_flight_--;
+            ok = ok && c.entry.result == static_cast<uint32_t>(yield_result::OK);
+            if (ok) {
+                eof_ = c.payload.empty();
+                window = std::move(c.payload);
+            }
+            net::post(executor_, [ok, handler = std::move(handler)] { handler(ok); });
+        });
     }
-    res.keep_alive(false);
-    res.body() = std::move(body);
-    res.prepare_payload();
 
-    std::ignore = std::move(req);
-    return res;
-}
+private:
+    void post_head(head_handler handler, bool ok, http::response_header<> &&head, std::string_view why) {
+        net::post(executor_, [ok, head = std::move(head), why, handler = std::move(handler)]() mutable {
+            handler(ok, std::move(head), why);
+        });
+    }
+
+    // Decode the REQUEST completion into head, returns why it failed or nothing
+    std::string_view on_head(bool ok, const fetch_ring::completion &c, unsigned version, http::response_header<> &head) {
+        if (!ok) {
+            return "Request submission failed";
+        }
+        yield_res res_header;
+        if (c.entry.result != static_cast<uint32_t>(yield_result::OK) || c.payload.length() < sizeof(res_header)) {
+            open_ = false; // Failed fetches are released by the host
+            return "Fetch failed, either due to CORS policy violation or network error.";
+        }
+        memcpy(&res_header, c.payload.data(), sizeof(res_header));
+        if (res_header.version != YIELD_WIRE_VERSION || res_header.length != c.payload.length()) {
+            return "Malformed response payload";
+        }
+        open_ = res_header.body_done == 0;
+
+        // The body is decoded by the browser and streamed, so its original framing does not apply
+        payload_reader reader{std::string_view(c.payload).substr(sizeof(res_header))};
+        head.result(http::int_to_status(res_header.status));
+        head.version(version);
+        for (uint32_t i = 0; i < res_header.headers_count; ++i) {
+            yield_field field;
+            std::string_view name;
+            std::string_view value;
+            if (!reader.read(field) || !reader.read(name, field.name_length) || !reader.read(value, field.value_length)) {
+                return "Malformed response payload";
+            }
+            const http::field known = http::string_to_field(name);
+            if (known != http::field::content_length && known != http::field::content_encoding &&
+                known != http::field::transfer_encoding && known != http::field::connection) {
+                head.set(name, value);
+            }
+        }
+        std::string_view inline_body;
+        if (!reader.read(inline_body, res_header.inline_body_length)) {
+            return "Malformed response payload";
+        }
+        window_ = inline_body;
+        return {};
+    }
+
+    // Release the fetch, completions of reads still in flight are dropped as they come
+    void close() {
+        if (!open_) {
+            return;
+        }
+        fetch_ring &ring = fetch_ring::instance();
+        ring.forget(uid_, in_flight_);
+        ring.submit(ring_op::CLOSE, uid_, {});
+        if (fetch_poller) {
+            fetch_poller->wake(); // Nobody waits on the fetch any more, but the submission may be queued
+        }
+        open_ = false;
+    }
+
+    net::any_io_executor executor_;
+    uint64_t uid_{rdcycle()};
+    uint64_t staged_length_{0};
+    std::string window_; // Leading body bytes that came with the response head
+    uint64_t in_flight_{0};
+    bool open_{false}; // The host still holds the fetch
+    bool eof_{false};
+};
 
 //------------------------------------------------------------------------------
 
+// TLS handshake counters, to check the session resumption hit rate
+struct tls_stats final {
+    uint64_t full{0};
+    uint64_t resumed{0};
+};
+
+static tls_stats handshake_stats; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Where statistics are reported on SIGUSR1, the proxy output itself is usually discarded
+static constexpr const char *STATS_LOG_PATH = "/var/log/https-proxy.log";
+
+static void report_stats() {
+    std::ofstream log(STATS_LOG_PATH, std::ios::app);
+    const uint64_t total = handshake_stats.full + handshake_stats.resumed;
+    log << "tls handshakes: " << handshake_stats.full << " full, " << handshake_stats.resumed << " resumed";
+    if (total > 0) {
+        log << " (" << (handshake_stats.resumed * 100 / total) << "% resumed)";
+    }
+    log << "\n";
+    const sign_offload_stats signs = sign_offload_get_stats();
+    log << "certificate signatures: " << signs.offloaded << " offloaded, " << signs.local << " in guest\n";
+    const record_offload_stats records = record_offload_get_stats();
+    log << "record encryption: " << records.offloaded << " records (" << records.offloaded_bytes << " bytes) offloaded, "
+        << records.local << " in guest\n";
+}
+
+// Report statistics each time SIGUSR1 is received
+static void wait_stats_signal(net::signal_set &signals) {
+    signals.async_wait([&signals](beast::error_code ec, int /*signal*/) {
+        if (ec) {
+            return;
+        }
+        report_stats();
+        wait_stats_signal(signals);
+    });
+}
+
 // Report a failure
 static void fail(beast::error_code ec, char const *what) {
     // ssl::error::stream_truncated, also known as an SSL "short read",
@@ -222,7 +489,33 @@ class session {
         return static_cast<Derived &>(*this);
     }
 
-    http::request<http::string_body> req_;
+    // A request forwarded to the host, answered in the order requests arrived
+    struct exchange final {
+        std::unique_ptr<upstream_fetch> fetch;
+        unsigned version{11};
+        bool head_method{false};
+        bool keep_alive{false};
+        bool ready{false}; // The response head arrived, or the request failed
+        bool ok{false};
+        http::response_header<> head;
+        std::string why;
+    };
+
+    // Requests read ahead of the response being written, their fetches run meanwhile
+    static constexpr std::size_t PIPELINE_LIMIT = 8;
+
+    std::optional<http::request_parser<http::buffer_body>> parser_;
+    http::response<http::empty_body> continue_{http::status::continue_, 11};
+    std::string body_window_; // Request body read from the client, staged once full
+    std::deque<std::unique_ptr<exchange>> exchanges_; // The front one is being answered
+    std::optional<http::response<http::buffer_body>> res_;
+    std::optional<http::response_serializer<http::buffer_body>> sr_;
+    std::string window_;
+    bool reading_{false}; // A request is being read
+    bool read_closed_{false}; // No more requests will be read
+    bool writing_{false}; // The front exchange response is being written
+    bool continue_deferred_{false}; // The request being read waits for 100 Continue behind other responses
+    bool closing_{false};
 
 protected:
     beast::flat_buffer buffer_; // NOLINT(cppcoreguidelines-non-private-member-variables-in-classes)
@@ -236,38 +529,179 @@ public:
         // Set the timeout.
         // beast::get_lowest_layer(derived().stream()).expires_after(std::chrono::seconds(30));
 
-        // Read a request
-        http::async_read(derived().stream(), buffer_, req_,
-            beast::bind_front_handler(&session::on_read, derived().shared_from_this()));
+        // Pipelined requests are read while earlier responses are written, up to a limit
+        if (reading_ || read_closed_ || exchanges_.size() >= PIPELINE_LIMIT) {
+            return;
+        }
+
+        // Read a request head, its body is streamed to the host as it comes
+        reading_ = true;
+        parser_.emplace();
+        parser_->body_limit(boost::none);
+        http::async_read_header(derived().stream(), buffer_, *parser_,
+            beast::bind_front_handler(&session::on_read_header, derived().shared_from_this()));
     }
 
-    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+    void on_read_header(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
-        // This means they closed the connection
+        // This means they closed the connection, answer what was already asked
         if (ec == http::error::end_of_stream) {
-            derived().do_eof();
+            stop_reading();
             return;
         }
 
         if (ec) {
+            stop_reading();
             fail(ec, "read");
             return;
         }
 
-        // Send the response
-        send_response(handle_request(std::move(req_)));
+        const http::request<http::buffer_body> &req = parser_->get();
+        auto &ex = exchanges_.emplace_back(std::make_unique<exchange>());
+        ex->fetch = std::make_unique<upstream_fetch>(derived().stream().get_executor());
+        ex->version = req.version();
+        ex->head_method = req.method() == http::verb::head;
+        ex->keep_alive = req.keep_alive();
+        body_window_.clear();
+        if (parser_->is_done()) {
+            forward_request(0);
+            return;
+        }
+
+        // Clients waiting for permission to send the body get it once earlier responses are out
+        if (beast::iequals(req[http::field::expect], "100-continue")) {
+            if (exchanges_.size() > 1) {
+                continue_deferred_ = true;
+                return;
+            }
+            write_continue();
+            return;
+        }
+        do_read_body(0);
     }
 
-    void send_response(http::message_generator &&msg) {
-        const bool keep_alive = msg.keep_alive();
+    void write_continue() {
+        continue_deferred_ = false;
+        writing_ = true;
+        http::async_write(derived().stream(), continue_,
+            beast::bind_front_handler(&session::on_write_continue, derived().shared_from_this()));
+    }
 
-        // Write the response
-        beast::async_write(derived().stream(), std::move(msg),
-            beast::bind_front_handler(&session::on_write, derived().shared_from_this(), keep_alive));
+    void on_write_continue(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        writing_ = false;
+        if (ec) {
+            fail(ec, "write");
+            return;
+        }
+
+        do_read_body(0);
     }
 
-    void on_write(bool keep_alive, beast::error_code ec, std::size_t bytes_transferred) {
+    // Read the request body into the window, from offset on
+    void do_read_body(std::size_t offset) {
+        body_window_.resize(RING_PAYLOAD_MAX);
+        parser_->get().body().data = body_window_.data() + offset;
+        parser_->get().body().size = body_window_.size() - offset;
+        http::async_read(derived().stream(), buffer_, *parser_,
+            beast::bind_front_handler(&session::on_read_body, derived().shared_from_this()));
+    }
+
+    void on_read_body(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        // The window is full
+        if (ec == http::error::need_buffer) {
+            ec = {};
+        }
+
+        if (ec) {
+            // The request can not be answered, neither can the ones after it
+            exchanges_.pop_back();
+            stop_reading();
+            fail(ec, "read");
+            return;
+        }
+
+        const std::size_t length = body_window_.size() - parser_->get().body().size;
+        if (parser_->is_done()) {
+            forward_request(length);
+            return;
+        }
+
+        // Stage full windows, peak memory does not depend on the upload size
+        if (length == body_window_.size()) {
+            if (!exchanges_.back()->fetch->stage_body(body_window_)) {
+                exchange &ex = *exchanges_.back();
+                ex.ready = true;
+                ex.why = "Request body submission failed";
+                stop_reading();
+                if (!writing_ && &ex == exchanges_.front().get()) {
+                    start_response();
+                }
+                return;
+            }
+            do_read_body(0);
+            return;
+        }
+        do_read_body(length);
+    }
+
+    // Forward the request with the last body_length bytes of its body, then read the next one,
+    // the exchange is parked until the host answers while other sessions keep going
+    void forward_request(std::size_t body_length) {
+        exchange &ex = *exchanges_.back();
+        ex.fetch->async_start(parser_->get(), std::string_view(body_window_.data(), body_length),
+            beast::bind_front_handler(&session::on_response_head, derived().shared_from_this(), &ex));
+        reading_ = false;
+        if (!ex.keep_alive) {
+            stop_reading();
+            return;
+        }
+        do_read();
+    }
+
+    void on_response_head(exchange *ex, bool ok, http::response_header<> &&head, std::string_view why) {
+        if (closing_) {
+            return;
+        }
+        ex->ready = true;
+        ex->ok = ok;
+        ex->head = std::move(head);
+        ex->why = why;
+        if (!writing_ && ex == exchanges_.front().get()) {
+            start_response();
+        }
+    }
+
+    // Send the front response head, then stream the body as it comes, on failure answer right away.
+    // Bodies have no known length, so HTTP/1.1 clients get them chunked and older ones until close.
+    void start_response() {
+        exchange &ex = *exchanges_.front();
+        writing_ = true;
+        if (!ex.ok) {
+            send_response(bad_request(ex.version, ex.why));
+            return;
+        }
+
+        res_.emplace(std::move(ex.head));
+        const bool bodiless = ex.head_method || res_->result() == http::status::no_content ||
+            res_->result() == http::status::not_modified;
+        if (!bodiless && ex.version >= 11) {
+            res_->chunked(true);
+        }
+        ex.keep_alive = ex.keep_alive && (bodiless || res_->chunked());
+        res_->keep_alive(ex.keep_alive);
+        res_->body().data = nullptr;
+        res_->body().more = !bodiless;
+        sr_.emplace(*res_);
+        http::async_write_header(derived().stream(), *sr_,
+            beast::bind_front_handler(&session::on_write_header, derived().shared_from_this()));
+    }
+
+    void on_write_header(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
         if (ec) {
@@ -275,16 +709,121 @@ public:
             return;
         }
 
+        do_write_body();
+    }
+
+    void do_write_body() {
+        if (!res_->body().more) {
+            window_.clear();
+            on_read_window(true);
+            return;
+        }
+        exchanges_.front()->fetch->async_read_window(window_,
+            beast::bind_front_handler(&session::on_read_window, derived().shared_from_this()));
+    }
+
+    void on_read_window(bool ok) {
+        if (!ok) {
+            // Too late for an error response, cut the body short
+            std::cerr << "fetch: response body read failed\n";
+            close();
+            return;
+        }
+        res_->body().data = window_.empty() ? nullptr : window_.data();
+        res_->body().size = window_.size();
+        res_->body().more = !window_.empty();
+        http::async_write(derived().stream(), *sr_,
+            beast::bind_front_handler(&session::on_write_body, derived().shared_from_this()));
+    }
+
+    void on_write_body(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        // The window was written, ask for the next one
+        if (ec == http::error::need_buffer) {
+            do_write_body();
+            return;
+        }
+
+        if (ec) {
+            fail(ec, "write");
+            return;
+        }
+
+        end_response(exchanges_.front()->keep_alive);
+    }
+
+    // The front response is out, move on to the next exchange or close
+    void end_response(bool keep_alive) {
+        sr_.reset();
+        res_.reset();
+        window_.clear();
+        exchanges_.pop_front();
+        writing_ = false;
         if (!keep_alive) {
             // This means we should close the connection, usually because
             // the response indicated the "Connection: close" semantic.
-            derived().do_eof();
+            close();
+            return;
+        }
+        if (continue_deferred_ && exchanges_.size() == 1) {
+            write_continue();
+            return;
+        }
+        if (!exchanges_.empty() && exchanges_.front()->ready) {
+            start_response();
+            return;
+        }
+        if (exchanges_.empty() && read_closed_ && !reading_) {
+            close();
             return;
         }
 
-        // Read another request
+        // Resume reading requests if the pipeline was full
         do_read();
     }
+
+    // No more requests are read, close once the pending ones are answered
+    void stop_reading() {
+        reading_ = false;
+        read_closed_ = true;
+        if (continue_deferred_) {
+            continue_deferred_ = false;
+            exchanges_.pop_back(); // Its body was never asked for
+        }
+        if (exchanges_.empty() && !writing_) {
+            close();
+        }
+    }
+
+    // Close the connection, exchanges still waiting for the host are kept until it answers
+    void close() {
+        if (closing_) {
+            return;
+        }
+        closing_ = true;
+        read_closed_ = true;
+        derived().do_eof();
+    }
+
+    void send_response(http::message_generator &&msg) {
+        const bool keep_alive = msg.keep_alive();
+
+        // Write the response
+        beast::async_write(derived().stream(), std::move(msg),
+            beast::bind_front_handler(&session::on_write, derived().shared_from_this(), keep_alive));
+    }
+
+    void on_write(bool keep_alive, beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        if (ec) {
+            fail(ec, "write");
+            return;
+        }
+
+        end_response(keep_alive);
+    }
 };
 
 // Handles a plain HTTP connection
@@ -360,7 +899,13 @@ public:
         // Consume the portion of the buffer used by the handshake
         buffer_.consume(bytes_used);
 
-        // Certificate injection happens in SNI callback before handshake completes
+        if (SSL_session_reused(stream_.native_handle()) != 0) {
+            handshake_stats.resumed++;
+        } else {
+            handshake_stats.full++;
+        }
+
+        // Certificate injection happens in the ClientHello callback before handshake completes
         do_read();
     }
 
@@ -423,13 +968,23 @@ static std::vector<uint8_t> build_dns_response(const uint8_t* query_buffer, std:
         size_t question_start = pos;
         size_t response_question_start = response.size(); // Track position in response
 
-        // Skip domain name labels
+        // Skip domain name labels, collecting the name
+        std::string name;
         while (pos < length && query_buffer[pos] != 0) {
             uint8_t label_len = query_buffer[pos];
             if (label_len >= 192) { // Compression pointer
                 pos += 2;
+                name.clear();
                 break;
             }
+            if (pos + 1 + label_len <= length) {
+                if (!name.empty()) {
+                    name.push_back('.');
+                }
+                for (size_t i = pos + 1; i < pos + 1 + label_len; ++i) {
+                    name.push_back(static_cast<char>(std::tolower(query_buffer[i])));
+                }
+            }
             pos += label_len + 1;
             if (pos >= length) return {};
         }
@@ -446,6 +1001,12 @@ static std::vector<uint8_t> build_dns_response(const uint8_t* query_buffer, std:
         // Copy question to response
         response.insert(response.end(), query_buffer + question_start, query_buffer + pos);
 
+        // Clients resolve a host right before connecting to it, so issue its certificate meanwhile
+        // (type 1 = A, 28 = AAAA, class 1 = IN)
+        if ((qtype == 1 || qtype == 28) && qclass == 1 && !name.empty()) {
+            cert_store::instance().prewarm(name);
+        }
+
         // Add answer if it's an A record query (type 1, class 1 = IN)
         if (qtype == 1 && qclass == 1) {
             // Name pointer to question (compression) - use position in response, not request
@@ -656,25 +1217,107 @@ private:
 
 //------------------------------------------------------------------------------
 
-// SNI callback to capture hostname and inject certificate
-static int sni_callback(SSL* ssl, int* /*ad*/, void* /*arg*/) {
-    const char* servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
-    if (servername && servername[0] != '\0') {
-        std::string hostname(servername);
-        auto cert_pair = cert_store::instance().issue_for_host(hostname);
-        if (cert_pair.cert && cert_pair.key) {
-            if (SSL_use_certificate(ssl, cert_pair.cert.get()) == 1 &&
-                SSL_use_PrivateKey(ssl, cert_pair.key.get()) == 1) {
-                // Certificate injected successfully
-                return SSL_TLSEXT_ERR_OK;
-            }
+// Host name in the data of a server_name extension, empty without one
+static std::string parse_server_name(const unsigned char *ext, size_t length) {
+    // A server_name_list length, then the first entry: name type, name length and name
+    if (length < 5 || static_cast<size_t>((ext[0] << 8) | ext[1]) != length - 2 || ext[2] != TLSEXT_NAMETYPE_host_name) {
+        return {};
+    }
+    const size_t name_length = (ext[3] << 8) | ext[4];
+    if (name_length > length - 5) {
+        return {};
+    }
+    return {reinterpret_cast<const char *>(ext + 5), name_length}; // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+// Server name requested by a ClientHello, empty without one
+static std::string client_hello_servername(SSL *ssl) {
+    const unsigned char *ext = nullptr;
+    size_t length = 0;
+    if (SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_server_name, &ext, &length) != 1) {
+        return {};
+    }
+    return parse_server_name(ext, length);
+}
+
+// Server name of a ClientHello at the start of received TLS records, before any SSL object sees it.
+// Returns nullopt while its first record is incomplete, an empty name without one or when it can not be parsed.
+static std::optional<std::string> buffered_servername(const unsigned char *data, size_t size) {
+    static constexpr size_t RECORD_HEADER = 5;
+    if (size < RECORD_HEADER) {
+        return std::nullopt;
+    }
+    const size_t record_length = (data[3] << 8) | data[4];
+    if (data[0] != SSL3_RT_HANDSHAKE || record_length > SSL3_RT_MAX_PLAIN_LENGTH) {
+        return std::string();
+    }
+    if (size < RECORD_HEADER + record_length) {
+        return std::nullopt;
+    }
+
+    // Walk the ClientHello in the first record, a message continued in the next record loses its tail
+    const unsigned char *msg = data + RECORD_HEADER;
+    size_t pos = 0;
+    const auto read_length = [&](size_t bytes, size_t &out) {
+        if (record_length - pos < bytes) {
+            return false;
+        }
+        out = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            out = (out << 8) | msg[pos++];
+        }
+        return true;
+    };
+    const auto skip = [&](size_t n) {
+        if (record_length - pos < n) {
+            return false;
+        }
+        pos += n;
+        return true;
+    };
+    const auto skip_vector = [&](size_t length_bytes) {
+        size_t n = 0;
+        return read_length(length_bytes, n) && skip(n);
+    };
+    if (record_length < 4 || msg[0] != SSL3_MT_CLIENT_HELLO) {
+        return std::string();
+    }
+    // Message header, client version and random, then session id, cipher suites, compression methods
+    // and the extensions length, bounded by the record instead
+    if (!skip(4 + 2 + SSL3_RANDOM_SIZE) || !skip_vector(1) || !skip_vector(2) || !skip_vector(1) || !skip(2)) {
+        return std::string();
+    }
+    size_t type = 0;
+    size_t length = 0;
+    while (read_length(2, type) && read_length(2, length) && record_length - pos >= length) {
+        if (type == TLSEXT_TYPE_server_name) {
+            return parse_server_name(msg + pos, length);
         }
+        pos += length;
     }
-    return SSL_TLSEXT_ERR_OK;
+    return std::string();
 }
 
-// Detects SSL handshakes
+// ClientHello callback switching to the context serving the certificate of the requested host.
+// It runs before the session lookup, so the session id context of the host context applies to it,
+// and sessions and tickets only resume on the host they were issued for.
+static int client_hello_callback(SSL *ssl, int * /*al*/, void * /*arg*/) {
+    const std::string servername = client_hello_servername(ssl);
+    if (!servername.empty()) {
+        SSL_CTX *host_ctx = cert_store::instance().context_for_host(servername);
+        if (host_ctx) {
+            SSL_set_SSL_CTX(ssl, host_ctx);
+        }
+    }
+    return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+// Detects SSL handshakes.
+// TLS connections read their ClientHello first, and wait for the certificate of the host it names to be issued
+// on the helper thread, so the handshake on the io thread never issues one itself.
 class detect_session : public std::enable_shared_from_this<detect_session> {
+    static constexpr size_t CLIENT_HELLO_READ = 4096;
+
     beast::tcp_stream stream_;
     ssl::context &ctx_; // NOLINT(cppcoreguidelines-avoid-const-or-ref-data-members)
     beast::flat_buffer buffer_;
@@ -698,14 +1341,52 @@ public:
         }
 
         if (result) {
-            // Launch SSL session
-            std::make_shared<ssl_session>(stream_.release_socket(), ctx_, std::move(buffer_))->run();
+            do_read_hello();
             return;
         }
 
         // Launch plain session
         std::make_shared<plain_session>(stream_.release_socket(), std::move(buffer_))->run();
     }
+
+private:
+    void do_read_hello() {
+        const auto *data = static_cast<const unsigned char *>(buffer_.data().data());
+        std::optional<std::string> servername = buffered_servername(data, buffer_.size());
+        if (!servername && buffer_.size() >= SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_HEADER_LENGTH) {
+            servername.emplace();
+        }
+        if (servername) {
+            on_servername(*servername);
+            return;
+        }
+        stream_.async_read_some(buffer_.prepare(CLIENT_HELLO_READ),
+            beast::bind_front_handler(&detect_session::on_read_hello, shared_from_this()));
+    }
+
+    void on_read_hello(beast::error_code ec, std::size_t bytes_transferred) {
+        if (ec) {
+            fail(ec, "read hello");
+            return;
+        }
+        buffer_.commit(bytes_transferred);
+        do_read_hello();
+    }
+
+    void on_servername(const std::string &servername) {
+        auto self = shared_from_this();
+        const auto ready = [self]() {
+            net::post(self->stream_.get_executor(), [self]() { self->start_ssl(); });
+        };
+        if (servername.empty() || cert_store::instance().context_ready(servername, ready)) {
+            start_ssl();
+        }
+    }
+
+    void start_ssl() {
+        // Launch SSL session
+        std::make_shared<ssl_session>(stream_.release_socket(), ctx_, std::move(buffer_))->run();
+    }
 };
 
 // Accepts incoming connections and launches the sessions
@@ -779,18 +1460,211 @@ private:
 
 //------------------------------------------------------------------------------
 
+// TLS algorithm choices, the defaults are accepted by every mainstream client (Ed25519 certificates are
+// cheaper to sign but rejected by many). Check with --bench on the target, which prints the options of
+// the cheapest combination.
+// ChaCha20 is the cheapest to encrypt in the guest, AES-GCM comes first only once the host has confirmed
+// it encrypts TLS 1.3 AES-GCM records (decryption still runs in the guest).
+struct tls_options final {
+    static constexpr const char *OFFLOAD_CIPHERSUITES =
+        "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384";
+
+    cert_store::key_type key{cert_store::key_type::P256};
+    std::string groups{"X25519:P-256"};
+    std::string ciphersuites{"TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"};
+    bool ciphersuites_given{false}; // Set with --ciphersuites, kept whether the host encrypts or not
+    std::string ciphers{"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+                        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256"}; // TLS 1.2
+};
+
+// Parse one --name=value option, returns false when arg is not a known option or its value is invalid
+static bool parse_tls_option(std::string_view arg, tls_options &opts) {
+    const size_t eq = arg.find('=');
+    if (!arg.starts_with("--") || eq == std::string_view::npos) {
+        return false;
+    }
+    const std::string_view name = arg.substr(2, eq - 2);
+    const std::string_view value = arg.substr(eq + 1);
+    if (name == "key") {
+        return cert_store::parse_key_type(value, opts.key);
+    }
+    if (name == "groups") {
+        opts.groups = value;
+    } else if (name == "ciphersuites") {
+        opts.ciphersuites = value;
+        opts.ciphersuites_given = true;
+    } else if (name == "ciphers") {
+        opts.ciphers = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Apply the algorithm choices, our preference order wins over the client's
+static bool apply_tls_options(ssl::context &ctx, const tls_options &opts) {
+    cert_store::instance().set_key_type(opts.key);
+    SSL_CTX_set_options(ctx.native_handle(), SSL_OP_CIPHER_SERVER_PREFERENCE);
+    return SSL_CTX_set1_groups_list(ctx.native_handle(), opts.groups.c_str()) == 1 &&
+        SSL_CTX_set_ciphersuites(ctx.native_handle(), opts.ciphersuites.c_str()) == 1 &&
+        SSL_CTX_set_cipher_list(ctx.native_handle(), opts.ciphers.c_str()) == 1;
+}
+
+// Configure the listening context, shared by all connections.
+// TLS 1.3 is preferred, it needs one round trip less and resumes without a full handshake.
+static bool setup_server_context(ssl::context &ctx, const tls_options &opts) {
+    SSL_CTX_set_min_proto_version(ctx.native_handle(), TLS1_2_VERSION);
+    if (!apply_tls_options(ctx, opts)) {
+        return false;
+    }
+
+    // Switch to the context of the requested host for dynamic certificate injection
+    SSL_CTX_set_client_hello_cb(ctx.native_handle(), client_hello_callback, nullptr);
+
+    // Set basic SSL context options
+    ctx.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 |
+        boost::asio::ssl::context::single_dh_use);
+
+    // Resume repeat connections from a server side session cache (TLS 1.2 session ids) and stateless tickets,
+    // both scoped per host by the session id context of the host context switched in by the ClientHello callback.
+    // Connections without a server name share this one.
+    static constexpr std::string_view default_sid_ctx = "https-proxy";
+    SSL_CTX_set_session_cache_mode(ctx.native_handle(), SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx.native_handle(), 1024);
+    SSL_CTX_set_timeout(ctx.native_handle(), 24 * 60 * 60);
+    SSL_CTX_set_session_id_context(ctx.native_handle(), reinterpret_cast<const unsigned char *>(default_sid_ctx.data()), // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        default_sid_ctx.size());
+    return true;
+}
+
+// Connect a client to the listening context over an in-memory BIO pair, offering session when given.
+// Returns the client session once the handshake is done, with the tickets TLS 1.3 sends after it.
+static SSL_SESSION *selftest_connect(SSL_CTX *server_ctx, SSL_CTX *client_ctx, const char *hostname,
+    SSL_SESSION *session, bool &resumed) {
+    std::unique_ptr<SSL, decltype(&SSL_free)> server(SSL_new(server_ctx), SSL_free);
+    std::unique_ptr<SSL, decltype(&SSL_free)> client(SSL_new(client_ctx), SSL_free);
+    BIO *server_bio = nullptr;
+    BIO *client_bio = nullptr;
+    if (!server || !client || BIO_new_bio_pair(&server_bio, 65536, &client_bio, 65536) != 1) {
+        return nullptr;
+    }
+    SSL_set_bio(server.get(), server_bio, server_bio);
+    SSL_set_bio(client.get(), client_bio, client_bio);
+    SSL_set_accept_state(server.get());
+    SSL_set_connect_state(client.get());
+    SSL_set_tlsext_host_name(client.get(), hostname);
+    if (session && SSL_set_session(client.get(), session) != 1) {
+        return nullptr;
+    }
+    char byte = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (SSL_is_init_finished(client.get())) {
+            SSL_read(client.get(), &byte, 1); // Processes the tickets
+        } else {
+            SSL_do_handshake(client.get());
+        }
+        SSL_do_handshake(server.get());
+    }
+    if (!SSL_is_init_finished(client.get()) || !SSL_is_init_finished(server.get())) {
+        return nullptr;
+    }
+    resumed = SSL_session_reused(server.get()) == 1;
+    // Sessions of connections not shut down cleanly are dropped from the cache
+    SSL_shutdown(client.get());
+    SSL_shutdown(server.get());
+    return SSL_get1_session(client.get());
+}
+
+// Check that sessions resume on the host they were issued for and on no other host, over TLS 1.2 and 1.3.
+// The certificates of both hosts are issued like on connections, so pass hosts pre-generated anyway.
+static int run_selftest(const tls_options &opts, const char *host, const char *other_host) {
+    ssl::context ctx{ssl::context::tls_server};
+    if (!setup_server_context(ctx, opts) || !cert_store::instance().ensure_ca()) {
+        std::cerr << "Failed to set up the server context\n";
+        return EXIT_FAILURE;
+    }
+    bool passed = true;
+    for (const int version : {TLS1_2_VERSION, TLS1_3_VERSION}) {
+        std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> client_ctx(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+        if (!client_ctx || SSL_CTX_set_max_proto_version(client_ctx.get(), version) != 1) {
+            return EXIT_FAILURE;
+        }
+        SSL_CTX_set_verify(client_ctx.get(), SSL_VERIFY_NONE, nullptr);
+        bool resumed = false;
+        bool same_host = false;
+        bool other = true;
+        SSL_SESSION *session = selftest_connect(ctx.native_handle(), client_ctx.get(), host, nullptr, resumed);
+        SSL_SESSION *same_session =
+            session ? selftest_connect(ctx.native_handle(), client_ctx.get(), host, session, same_host) : nullptr;
+        SSL_SESSION *other_session =
+            session ? selftest_connect(ctx.native_handle(), client_ctx.get(), other_host, session, other) : nullptr;
+        const bool ok = same_session && other_session && same_host && !other;
+        std::cout << (version == TLS1_3_VERSION ? "TLS 1.3" : "TLS 1.2") << ": resumed on " << host << ": "
+                  << (same_host ? "yes" : "no") << ", on " << other_host << ": " << (other ? "yes" : "no") << ", "
+                  << (ok ? "ok" : "FAILED") << "\n";
+        passed = passed && ok;
+        SSL_SESSION_free(session);
+        SSL_SESSION_free(same_session);
+        SSL_SESSION_free(other_session);
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Issue and save certificates for the given hosts ahead of time, so the first connections to them do no certificate work
+static int pregen_certs(int count, char *hosts[]) {
+    if (!cert_store::instance().ensure_ca()) {
+        std::cerr << "Failed to initialize certificate store\n";
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (!cert_store::instance().context_for_host(hosts[i])) {
+            std::cerr << "Failed to issue certificate for " << hosts[i] << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
+    // Leading options select TLS algorithms
+    tls_options opts;
+    int argi = 1;
+    for (; argi < argc && std::string_view(argv[argi]).find('=') != std::string_view::npos; ++argi) {
+        if (!parse_tls_option(argv[argi], opts)) {
+            std::cerr << "Invalid option: " << argv[argi] << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    if (argi < argc && std::string_view(argv[argi]) == "--bench") {
+        return run_crypto_bench();
+    }
+    if (argc - argi == 3 && std::string_view(argv[argi]) == "--selftest") {
+        return run_selftest(opts, argv[argi + 1], argv[argi + 2]);
+    }
+    if (argi < argc && std::string_view(argv[argi]) == "--pregen") {
+        cert_store::instance().set_key_type(opts.key);
+        return pregen_certs(argc - argi - 1, argv + argi + 1);
+    }
+
     // Check command line arguments.
-    if (argc != 4) {
-        std::cerr << "Usage: https-proxy <address> <port1> <port2>\n"
+    if (argc - argi != 3) {
+        std::cerr << "Usage: https-proxy [options] <address> <port1> <port2>\n"
+                  << "       https-proxy [options] --pregen <host>...\n"
+                  << "       https-proxy [options] --selftest <host> <other-host>\n"
+                  << "       https-proxy --bench\n"
+                  << "Options:\n"
+                  << "    --key=ed25519|p256|rsa2048   Certificate key algorithm\n"
+                  << "    --groups=<list>              Key exchange groups, in preference order\n"
+                  << "    --ciphersuites=<list>        TLS 1.3 cipher suites, in preference order\n"
+                  << "    --ciphers=<list>             TLS 1.2 ciphers, in preference order\n"
                   << "Example:\n"
                   << "    https-proxy 127.254.254.254 80 443\n"
                   << "This will also start a DNS server on port 53 that resolves all domains to <address>\n";
         return EXIT_FAILURE;
     }
-    auto const address = net::ip::make_address(argv[1]);
-    auto const port1 = static_cast<uint16_t>(std::strtol(argv[2], nullptr, 10));
-    auto const port2 = static_cast<uint16_t>(std::strtol(argv[3], nullptr, 10));
+    auto const address = net::ip::make_address(argv[argi]);
+    auto const port1 = static_cast<uint16_t>(std::strtol(argv[argi + 1], nullptr, 10));
+    auto const port2 = static_cast<uint16_t>(std::strtol(argv[argi + 2], nullptr, 10));
     auto const threads = 1;
 
     // Convert IP address to uint32 for DNS responses (network byte order)
@@ -805,8 +1679,25 @@ int main(int argc, char *argv[]) {
     // The io_context is required for all I/O
     net::io_context ioc{threads};
 
+    // Encrypt large response records on the host, before any SSL context looks up its ciphers
+    if (!record_offload_enable()) {
+        std::cerr << "Record encryption offload unavailable, encrypting in the guest\n";
+    } else if (!opts.ciphersuites_given) {
+        opts.ciphersuites = tls_options::OFFLOAD_CIPHERSUITES;
+    }
+
     // The SSL context is required, and holds certificates
-    ssl::context ctx{ssl::context::tlsv12};
+    ssl::context ctx{ssl::context::tls_server};
+    if (!setup_server_context(ctx, opts)) {
+        std::cerr << "Invalid TLS algorithm options\n";
+        return EXIT_FAILURE;
+    }
+
+    // Attach to the fetch ring shared with the host
+    if (!fetch_ring::instance().open("/dev/pmem1")) {
+        return EXIT_FAILURE;
+    }
+    fetch_poller = std::make_shared<ring_poller>(ioc);
 
     // Initialize certificate store
     if (!cert_store::instance().ensure_ca()) {
@@ -814,13 +1705,9 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    // Set up SNI callback for dynamic certificate injection
-    SSL_CTX_set_tlsext_servername_callback(ctx.native_handle(), sni_callback);
-    SSL_CTX_set_tlsext_servername_arg(ctx.native_handle(), nullptr);
-
-    // Set basic SSL context options
-    ctx.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 |
-        boost::asio::ssl::context::single_dh_use);
+    // Report handshake statistics with: kill -USR1 $(pidof https-proxy)
+    net::signal_set stats_signals(ioc, SIGUSR1);
+    wait_stats_signal(stats_signals);
 
     // Create and launch DNS servers on port 53 (both UDP and TCP)
     std::make_shared<dns_udp_server>(ioc, udp::endpoint{address, 53}, response_ip)->run();
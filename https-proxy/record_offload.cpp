@@ -0,0 +1,386 @@
+#include "record_offload.hpp"
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+#include <array>
+#include <atomic>
+#include <cstring>
+
+extern "C" uint64_t softyield(uint64_t a0, uint64_t a1, uint64_t a2);
+
+static constexpr uint64_t YIELD_ENCRYPT = 8; // yield_type::ENCRYPT
+static constexpr uint64_t YIELD_RESULT_OK = 0; // yield_result::OK
+static constexpr size_t OFFLOAD_MIN_BYTES = 1024; // Smaller records are cheaper to encrypt than to yield
+static constexpr size_t TAG_LENGTH = 16;
+static constexpr size_t PAGE_SIZE = 4096;
+static constexpr const char *PROVIDER_NAME = "record_offload";
+
+static std::atomic<uint64_t> offloaded{0};
+static std::atomic<uint64_t> offloaded_bytes{0};
+static std::atomic<uint64_t> local{0};
+static std::atomic<bool> host_unavailable{false}; // The host never encrypted, stop asking
+static constexpr size_t PROBE_BYTES = OFFLOAD_MIN_BYTES;
+
+struct offload_cipher final {
+    const char *names;
+    const char *name;
+};
+
+static constexpr std::array<offload_cipher, 2> CIPHERS = {{
+    {"AES-128-GCM:id-aes128-GCM:2.16.840.1.101.3.4.1.6", "AES-128-GCM"},
+    {"AES-256-GCM:id-aes256-GCM:2.16.840.1.101.3.4.1.46", "AES-256-GCM"},
+}};
+
+// Default implementations everything is delegated to, fetched before the provider is loaded
+static std::array<EVP_CIPHER *, CIPHERS.size()> base_ciphers{};
+
+// Cipher context, a default one plus what the host needs to encrypt a record by itself
+struct offload_ctx final {
+    EVP_CIPHER_CTX *base{nullptr};
+    bool encrypting{false};
+    bool tls1_mode{false}; // TLS 1.2 records, nonce and AAD handled inside the cipher
+    uint32_t key_length{0};
+    uint32_t iv_length{0};
+    uint32_t aad_length{0};
+    bool aad_overflow{false};
+    bool data_seen{false};
+    bool offloaded{false};
+    uint8_t key[32]{};
+    uint8_t iv[16]{};
+    uint8_t aad[32]{};
+    uint8_t tag[TAG_LENGTH]{};
+};
+
+// Make the pages of a buffer present and writable, the host writes through guest page tables
+static void touch_pages(unsigned char *buf, size_t length) {
+    for (size_t off = 0; off < length; off += PAGE_SIZE) {
+        volatile unsigned char *p = buf + off;
+        *p = *p;
+    }
+    volatile unsigned char *last = buf + length - 1;
+    *last = *last;
+}
+
+// Encrypt a whole record on the host, false when it has to be encrypted in the guest
+static bool offload_record(offload_ctx *ctx, unsigned char *out, size_t outsize, const unsigned char *in, size_t inl) {
+    if (!ctx->encrypting || ctx->tls1_mode || ctx->data_seen || ctx->aad_overflow || ctx->key_length == 0 ||
+        ctx->iv_length == 0 || inl < OFFLOAD_MIN_BYTES || inl > YIELD_ENCRYPT_MAX || outsize < inl ||
+        host_unavailable) {
+        return false;
+    }
+    yield_encrypt req;
+    req.algorithm = static_cast<uint32_t>(encrypt_algorithm::AES_GCM);
+    req.key_length = ctx->key_length;
+    req.iv_length = ctx->iv_length;
+    req.aad_length = ctx->aad_length;
+    req.length = inl;
+    req.input = reinterpret_cast<uint64_t>(in); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    req.output = reinterpret_cast<uint64_t>(out); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    memcpy(req.key, ctx->key, ctx->key_length);
+    memcpy(req.iv, ctx->iv, ctx->iv_length);
+    memcpy(req.aad, ctx->aad, ctx->aad_length);
+    touch_pages(out, inl);
+    // a0 is left untouched when soft yields are not handled by the host
+    const uint64_t result = softyield(YIELD_ENCRYPT, reinterpret_cast<uint64_t>(&req), 0); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    OPENSSL_cleanse(req.key, sizeof(req.key));
+    if (result != YIELD_RESULT_OK || req.tag_length != TAG_LENGTH) {
+        if (offloaded == 0) {
+            host_unavailable = true;
+        }
+        return false;
+    }
+    memcpy(ctx->tag, req.tag, TAG_LENGTH);
+    ctx->offloaded = true;
+    offloaded++;
+    offloaded_bytes += inl;
+    return true;
+}
+
+// Encrypt one record with a zero key on the host and compare it with the default implementation
+static bool probe_host() {
+    std::array<unsigned char, PROBE_BYTES> plaintext{};
+    std::array<unsigned char, PROBE_BYTES> expected{};
+    std::array<unsigned char, PROBE_BYTES> actual{};
+    std::array<unsigned char, TAG_LENGTH> expected_tag{};
+    yield_encrypt req;
+    req.algorithm = static_cast<uint32_t>(encrypt_algorithm::AES_GCM);
+    req.key_length = 16;
+    req.iv_length = 12;
+    req.length = PROBE_BYTES;
+    req.input = reinterpret_cast<uint64_t>(plaintext.data()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    req.output = reinterpret_cast<uint64_t>(actual.data()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    touch_pages(actual.data(), actual.size());
+    const uint64_t result = softyield(YIELD_ENCRYPT, reinterpret_cast<uint64_t>(&req), 0); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    if (result != YIELD_RESULT_OK || req.tag_length != TAG_LENGTH) {
+        return false;
+    }
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int outl = 0;
+    int finl = 0;
+    const bool ok = ctx && EVP_EncryptInit_ex2(ctx, base_ciphers[0], req.key, req.iv, nullptr) == 1 &&
+        EVP_EncryptUpdate(ctx, expected.data(), &outl, plaintext.data(), static_cast<int>(plaintext.size())) == 1 &&
+        EVP_EncryptFinal_ex(ctx, expected.data() + outl, &finl) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LENGTH, expected_tag.data()) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok && expected == actual && memcmp(expected_tag.data(), req.tag, TAG_LENGTH) == 0;
+}
+
+template <size_t I>
+static void *offload_newctx(void * /*provctx*/) {
+    auto *ctx = new offload_ctx;
+    ctx->base = EVP_CIPHER_CTX_new();
+    if (!ctx->base || EVP_EncryptInit_ex2(ctx->base, base_ciphers[I], nullptr, nullptr, nullptr) != 1) {
+        EVP_CIPHER_CTX_free(ctx->base);
+        delete ctx;
+        return nullptr;
+    }
+    return ctx;
+}
+
+static void offload_freectx(void *vctx) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    EVP_CIPHER_CTX_free(ctx->base);
+    OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+    delete ctx;
+}
+
+static void *offload_dupctx(void *vctx) {
+    const auto *ctx = static_cast<offload_ctx *>(vctx);
+    auto *dup = new offload_ctx(*ctx);
+    dup->base = EVP_CIPHER_CTX_new();
+    if (!dup->base || EVP_CIPHER_CTX_copy(dup->base, ctx->base) != 1) {
+        offload_freectx(dup);
+        return nullptr;
+    }
+    return dup;
+}
+
+static int offload_init(void *vctx, const unsigned char *key, size_t keylen, const unsigned char *iv, size_t ivlen,
+    const OSSL_PARAM params[], int enc) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    if (EVP_CipherInit_ex2(ctx->base, nullptr, key, iv, enc, params) != 1) {
+        return 0;
+    }
+    ctx->encrypting = enc != 0;
+    if (key != nullptr) {
+        ctx->key_length = keylen <= sizeof(ctx->key) ? keylen : 0;
+        memcpy(ctx->key, key, ctx->key_length);
+    }
+    if (iv != nullptr) {
+        ctx->iv_length = ivlen <= sizeof(ctx->iv) ? ivlen : 0;
+        memcpy(ctx->iv, iv, ctx->iv_length);
+    }
+    ctx->aad_length = 0;
+    ctx->aad_overflow = false;
+    ctx->data_seen = false;
+    ctx->offloaded = false;
+    return 1;
+}
+
+static int offload_encrypt_init(void *vctx, const unsigned char *key, size_t keylen, const unsigned char *iv,
+    size_t ivlen, const OSSL_PARAM params[]) {
+    return offload_init(vctx, key, keylen, iv, ivlen, params, 1);
+}
+
+static int offload_decrypt_init(void *vctx, const unsigned char *key, size_t keylen, const unsigned char *iv,
+    size_t ivlen, const OSSL_PARAM params[]) {
+    return offload_init(vctx, key, keylen, iv, ivlen, params, 0);
+}
+
+// TLS 1.3 encrypts each record with the AAD in one update and the whole plaintext in the next
+static int offload_update(void *vctx, unsigned char *out, size_t *outl, size_t outsize, const unsigned char *in,
+    size_t inl) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    if (ctx->offloaded) {
+        return 0;
+    }
+    if (out == nullptr) {
+        if (!ctx->data_seen && ctx->aad_length + inl <= sizeof(ctx->aad)) {
+            memcpy(ctx->aad + ctx->aad_length, in, inl);
+            ctx->aad_length += inl;
+        } else {
+            ctx->aad_overflow = true;
+        }
+    } else if (offload_record(ctx, out, outsize, in, inl)) {
+        *outl = inl;
+        return 1;
+    }
+    int n = 0;
+    if (EVP_CipherUpdate(ctx->base, out, &n, in, static_cast<int>(inl)) != 1) {
+        return 0;
+    }
+    if (out != nullptr) {
+        ctx->data_seen = true;
+        if (ctx->encrypting) {
+            local++;
+        }
+    }
+    *outl = n;
+    return 1;
+}
+
+static int offload_final(void *vctx, unsigned char *out, size_t *outl, size_t /*outsize*/) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    if (ctx->offloaded) {
+        *outl = 0;
+        return 1;
+    }
+    int n = 0;
+    if (EVP_CipherFinal_ex(ctx->base, out, &n) != 1) {
+        return 0;
+    }
+    *outl = n;
+    return 1;
+}
+
+// One shot encryption of TLS 1.2 records, always in the guest
+static int offload_cipher_fn(void *vctx, unsigned char *out, size_t *outl, size_t /*outsize*/, const unsigned char *in,
+    size_t inl) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    const int n = EVP_Cipher(ctx->base, out, in, static_cast<unsigned int>(inl));
+    if (n < 0) {
+        return 0;
+    }
+    if (ctx->encrypting && out != nullptr) {
+        local++;
+    }
+    *outl = n;
+    return 1;
+}
+
+static int offload_get_ctx_params(void *vctx, OSSL_PARAM params[]) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    if (!ctx->offloaded) {
+        return EVP_CIPHER_CTX_get_params(ctx->base, params);
+    }
+    // The tag of an offloaded record comes from the host, the default context never saw the plaintext
+    for (OSSL_PARAM *p = params; p->key != nullptr; ++p) {
+        if (strcmp(p->key, OSSL_CIPHER_PARAM_AEAD_TAG) == 0) {
+            if (p->data_size == 0 || p->data_size > TAG_LENGTH || OSSL_PARAM_set_octet_string(p, ctx->tag, p->data_size) != 1) {
+                return 0;
+            }
+            continue;
+        }
+        std::array<OSSL_PARAM, 2> one = {*p, OSSL_PARAM_construct_end()};
+        if (EVP_CIPHER_CTX_get_params(ctx->base, one.data()) != 1) {
+            return 0;
+        }
+        p->return_size = one[0].return_size;
+    }
+    return 1;
+}
+
+static int offload_set_ctx_params(void *vctx, const OSSL_PARAM params[]) {
+    auto *ctx = static_cast<offload_ctx *>(vctx);
+    if (params != nullptr && (OSSL_PARAM_locate_const(params, OSSL_CIPHER_PARAM_AEAD_TLS1_AAD) != nullptr ||
+                                 OSSL_PARAM_locate_const(params, OSSL_CIPHER_PARAM_AEAD_TLS1_IV_FIXED) != nullptr)) {
+        ctx->tls1_mode = true;
+    }
+    return EVP_CIPHER_CTX_set_params(ctx->base, params);
+}
+
+template <size_t I>
+static int offload_get_params(OSSL_PARAM params[]) {
+    return EVP_CIPHER_get_params(base_ciphers[I], params);
+}
+
+template <size_t I>
+static const OSSL_PARAM *offload_gettable_params(void * /*provctx*/) {
+    return EVP_CIPHER_gettable_params(base_ciphers[I]);
+}
+
+template <size_t I>
+static const OSSL_PARAM *offload_gettable_ctx_params(void * /*cctx*/, void * /*provctx*/) {
+    return EVP_CIPHER_gettable_ctx_params(base_ciphers[I]);
+}
+
+template <size_t I>
+static const OSSL_PARAM *offload_settable_ctx_params(void * /*cctx*/, void * /*provctx*/) {
+    return EVP_CIPHER_settable_ctx_params(base_ciphers[I]);
+}
+
+template <typename F>
+static auto dispatch_fn(F *fn) {
+    return reinterpret_cast<void (*)()>(fn); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+template <size_t I>
+static const OSSL_DISPATCH cipher_functions[] = {
+    {OSSL_FUNC_CIPHER_NEWCTX, dispatch_fn(offload_newctx<I>)},
+    {OSSL_FUNC_CIPHER_FREECTX, dispatch_fn(offload_freectx)},
+    {OSSL_FUNC_CIPHER_DUPCTX, dispatch_fn(offload_dupctx)},
+    {OSSL_FUNC_CIPHER_ENCRYPT_INIT, dispatch_fn(offload_encrypt_init)},
+    {OSSL_FUNC_CIPHER_DECRYPT_INIT, dispatch_fn(offload_decrypt_init)},
+    {OSSL_FUNC_CIPHER_UPDATE, dispatch_fn(offload_update)},
+    {OSSL_FUNC_CIPHER_FINAL, dispatch_fn(offload_final)},
+    {OSSL_FUNC_CIPHER_CIPHER, dispatch_fn(offload_cipher_fn)},
+    {OSSL_FUNC_CIPHER_GET_PARAMS, dispatch_fn(offload_get_params<I>)},
+    {OSSL_FUNC_CIPHER_GET_CTX_PARAMS, dispatch_fn(offload_get_ctx_params)},
+    {OSSL_FUNC_CIPHER_SET_CTX_PARAMS, dispatch_fn(offload_set_ctx_params)},
+    {OSSL_FUNC_CIPHER_GETTABLE_PARAMS, dispatch_fn(offload_gettable_params<I>)},
+    {OSSL_FUNC_CIPHER_GETTABLE_CTX_PARAMS, dispatch_fn(offload_gettable_ctx_params<I>)},
+    {OSSL_FUNC_CIPHER_SETTABLE_CTX_PARAMS, dispatch_fn(offload_settable_ctx_params<I>)},
+    {0, nullptr},
+};
+
+static const OSSL_ALGORITHM offload_algorithms[] = {
+    {CIPHERS[0].names, "provider=record_offload", cipher_functions<0>, "AES-128-GCM encrypting records on the host"},
+    {CIPHERS[1].names, "provider=record_offload", cipher_functions<1>, "AES-256-GCM encrypting records on the host"},
+    {nullptr, nullptr, nullptr, nullptr},
+};
+
+static const OSSL_ALGORITHM *offload_query(void * /*provctx*/, int operation_id, int *no_cache) {
+    *no_cache = 0;
+    return operation_id == OSSL_OP_CIPHER ? offload_algorithms : nullptr;
+}
+
+static int offload_provider_init(const OSSL_CORE_HANDLE * /*handle*/, const OSSL_DISPATCH * /*in*/,
+    const OSSL_DISPATCH **out, void **provctx) {
+    static const OSSL_DISPATCH functions[] = {
+        {OSSL_FUNC_PROVIDER_QUERY_OPERATION, dispatch_fn(offload_query)},
+        {0, nullptr},
+    };
+    *out = functions;
+    *provctx = &base_ciphers;
+    return 1;
+}
+
+bool record_offload_enable() {
+    static bool enabled = false;
+    if (enabled) {
+        return true;
+    }
+    if (host_unavailable) {
+        return false;
+    }
+    for (size_t i = 0; i < CIPHERS.size(); ++i) {
+        if (!base_ciphers[i]) {
+            base_ciphers[i] = EVP_CIPHER_fetch(nullptr, CIPHERS[i].name, "provider=default");
+        }
+        if (!base_ciphers[i]) {
+            return false;
+        }
+    }
+    // Only take over AES-GCM once the host has encrypted a record correctly
+    if (!probe_host()) {
+        host_unavailable = true;
+        return false;
+    }
+    // Loading a provider explicitly stops the default one from being loaded implicitly, and SSL contexts
+    // look up their ciphers once when created, with the default properties preferring ours
+    if (!OSSL_PROVIDER_load(nullptr, "default") ||
+        OSSL_PROVIDER_add_builtin(nullptr, PROVIDER_NAME, offload_provider_init) != 1 ||
+        !OSSL_PROVIDER_load(nullptr, PROVIDER_NAME) ||
+        EVP_set_default_properties(nullptr, "?provider=record_offload") != 1) {
+        return false;
+    }
+    enabled = true;
+    return true;
+}
+
+record_offload_stats record_offload_get_stats() {
+    return record_offload_stats{offloaded, offloaded_bytes, local};
+}
@@ -0,0 +1,53 @@
+#ifndef RECORD_OFFLOAD_HPP
+#define RECORD_OFFLOAD_HPP
+
+#include <cstdint>
+
+// TLS record encryption offloaded to the host through ENCRYPT soft yields. Large downloads spend most
+// guest cycles encrypting response records, the host encrypts them natively with WebCrypto instead.
+//
+// A built-in provider registers AES-GCM ciphers preferred over the default ones. They hand each large
+// record to be encrypted to the host, everything else (decryption, small records, TLS 1.2 records)
+// goes to the default implementation. OpenSSL encrypts one record per cipher call, so records are
+// offloaded one at a time, each up to 16 KiB. ChaCha20-Poly1305 is not offered by WebCrypto and keeps
+// encrypting in the guest. The host is probed with one record first, when it does not encrypt, for
+// instance outside the emulator, nothing is offloaded.
+
+// ENCRYPT soft yield request at a1, the host writes the ciphertext to output, fills in the tag and
+// returns yield_result in a0. Layout must match webcm.cpp.
+static constexpr uint32_t YIELD_ENCRYPT_VERSION = 1;
+static constexpr uint64_t YIELD_ENCRYPT_MAX = 65536; // Largest plaintext of a request
+
+enum class encrypt_algorithm : uint32_t {
+    AES_GCM = 1, // 128 or 256 bit key, 16 byte tag
+};
+
+struct yield_encrypt final {
+    uint32_t version{YIELD_ENCRYPT_VERSION};
+    uint32_t algorithm{0};
+    uint32_t key_length{0};
+    uint32_t iv_length{0};
+    uint32_t aad_length{0};
+    uint32_t tag_length{0}; // Filled by the host
+    uint64_t length{0}; // Plaintext bytes
+    uint64_t input{0}; // Guest virtual address of the plaintext
+    uint64_t output{0}; // Guest virtual address of the ciphertext, may be the same as input
+    uint8_t key[32]{};
+    uint8_t iv[16]{};
+    uint8_t aad[32]{};
+    uint8_t tag[16]{};
+};
+
+struct record_offload_stats final {
+    uint64_t offloaded{0};
+    uint64_t offloaded_bytes{0};
+    uint64_t local{0}; // Encrypted in the guest, too small or the host did not encrypt
+};
+
+// Prefer the offloading ciphers in SSL contexts created from now on, returns false when they can not be set up
+// or the host does not encrypt
+bool record_offload_enable();
+
+record_offload_stats record_offload_get_stats();
+
+#endif // RECORD_OFFLOAD_HPP
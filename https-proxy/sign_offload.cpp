@@ -0,0 +1,98 @@
+// EC_KEY_METHOD is deprecated in favor of providers, which can not hook signing of an existing key type
+#define OPENSSL_API_COMPAT 10101
+
+#include "sign_offload.hpp"
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+extern "C" uint64_t softyield(uint64_t a0, uint64_t a1, uint64_t a2);
+
+static constexpr uint64_t YIELD_SIGN = 7; // yield_type::SIGN
+static constexpr uint64_t YIELD_RESULT_OK = 0; // yield_result::OK
+
+// Signatures also happen on the certificate helper thread
+static std::atomic<uint64_t> offloaded{0};
+static std::atomic<uint64_t> local{0};
+
+using sign_sig_fn = ECDSA_SIG *(*)(const unsigned char *dgst, int dgst_len, const BIGNUM *in_kinv, const BIGNUM *in_r,
+    EC_KEY *eckey);
+
+static sign_sig_fn default_sign_sig = nullptr;
+
+static ECDSA_SIG *offload_sign_sig(const unsigned char *dgst, int dgst_len, const BIGNUM *in_kinv, const BIGNUM *in_r,
+    EC_KEY *eckey) {
+    // Precomputed nonces only come from explicit ECDSA_sign_setup callers, which the host can not honor
+    const BIGNUM *priv = EC_KEY_get0_private_key(eckey);
+    if (in_kinv == nullptr && in_r == nullptr && priv != nullptr && dgst_len > 0) {
+        yield_sign req;
+        req.algorithm = static_cast<uint32_t>(sign_algorithm::ECDSA_P256);
+        req.digest_length = std::min<uint32_t>(dgst_len, sizeof(req.digest));
+        memcpy(req.digest, dgst, req.digest_length);
+        if (BN_bn2binpad(priv, req.key, sizeof(req.key)) == sizeof(req.key)) {
+            // a0 is left untouched when soft yields are not handled by the host
+            const uint64_t result = softyield(YIELD_SIGN, reinterpret_cast<uint64_t>(&req), 0); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+            OPENSSL_cleanse(req.key, sizeof(req.key));
+            if (result == YIELD_RESULT_OK && req.signature_length == 64) {
+                BIGNUM *r = BN_bin2bn(req.signature, 32, nullptr);
+                BIGNUM *s = BN_bin2bn(req.signature + 32, 32, nullptr);
+                ECDSA_SIG *sig = ECDSA_SIG_new();
+                if (r && s && sig && ECDSA_SIG_set0(sig, r, s) == 1) {
+                    offloaded++;
+                    return sig;
+                }
+                ECDSA_SIG_free(sig);
+                BN_free(r);
+                BN_free(s);
+            }
+        }
+        OPENSSL_cleanse(req.key, sizeof(req.key));
+    }
+    local++;
+    return default_sign_sig(dgst, dgst_len, in_kinv, in_r, eckey);
+}
+
+// Default method with the signature swapped, created once
+static const EC_KEY_METHOD *offload_method() {
+    static EC_KEY_METHOD *method = [] {
+        const EC_KEY_METHOD *base = EC_KEY_OpenSSL();
+        EC_KEY_METHOD *m = EC_KEY_METHOD_new(base);
+        if (!m) {
+            return m;
+        }
+        int (*sign)(int, const unsigned char *, int, unsigned char *, unsigned int *, const BIGNUM *, const BIGNUM *,
+            EC_KEY *) = nullptr;
+        int (*sign_setup)(EC_KEY *, BN_CTX *, BIGNUM **, BIGNUM **) = nullptr;
+        EC_KEY_METHOD_get_sign(base, &sign, &sign_setup, &default_sign_sig);
+        EC_KEY_METHOD_set_sign(m, sign, sign_setup, offload_sign_sig);
+        return m;
+    }();
+    return method;
+}
+
+EVP_PKEY *sign_offload_wrap(EVP_PKEY *key) {
+    if (EVP_PKEY_id(key) != EVP_PKEY_EC) {
+        return nullptr;
+    }
+    EC_KEY *ec = EVP_PKEY_get1_EC_KEY(key);
+    if (!ec) {
+        return nullptr;
+    }
+    // A legacy key with a custom method keeps signing through it, instead of a provider
+    EVP_PKEY *wrapped = EVP_PKEY_new();
+    if (EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)) != NID_X9_62_prime256v1 || !offload_method() ||
+        EC_KEY_set_method(ec, offload_method()) != 1 || !wrapped || EVP_PKEY_assign_EC_KEY(wrapped, ec) != 1) {
+        EVP_PKEY_free(wrapped);
+        EC_KEY_free(ec);
+        return nullptr;
+    }
+    return wrapped;
+}
+
+sign_offload_stats sign_offload_get_stats() {
+    return sign_offload_stats{offloaded, local};
+}
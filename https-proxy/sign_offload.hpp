@@ -0,0 +1,43 @@
+#ifndef SIGN_OFFLOAD_HPP
+#define SIGN_OFFLOAD_HPP
+
+#include <openssl/evp.h>
+#include <cstdint>
+
+// Certificate key signatures offloaded to the host through SIGN soft yields, the host signs natively
+// far faster than emulated code. The key travels with each request, the MITM keys are local trust
+// anchors shared by guest and host anyway.
+//
+// Only ECDSA P-256 keys are offloaded, through an EC_KEY_METHOD sign hook. EdDSA keys have no method
+// hook in OpenSSL (they would need a whole provider with its own key management), so they keep signing
+// in the guest. When the host does not sign, for instance outside the emulator, the guest signs itself.
+
+// SIGN soft yield request at a1, the host fills in the signature and returns yield_result in a0.
+// Layout must match webcm.cpp.
+static constexpr uint32_t YIELD_SIGN_VERSION = 1;
+
+enum class sign_algorithm : uint32_t {
+    ECDSA_P256 = 1, // Digest truncated to 32 bytes, signature is r then s, 32 bytes each big endian
+};
+
+struct yield_sign final {
+    uint32_t version{YIELD_SIGN_VERSION};
+    uint32_t algorithm{0};
+    uint32_t digest_length{0};
+    uint32_t signature_length{0}; // Filled by the host
+    uint8_t key[32]{}; // Private scalar, big endian
+    uint8_t digest[64]{};
+    uint8_t signature[64]{};
+};
+
+struct sign_offload_stats final {
+    uint64_t offloaded{0};
+    uint64_t local{0}; // Signed in the guest because the host did not
+};
+
+// Return a key signing through the host, or nullptr when the key can not be offloaded
+EVP_PKEY* sign_offload_wrap(EVP_PKEY* key);
+
+sign_offload_stats sign_offload_get_stats();
+
+#endif // SIGN_OFFLOAD_HPP
@@ -0,0 +1,2 @@
+# Let the host know the shell is ready to prompt for input
+webcm-yield ready
@@ -0,0 +1,69 @@
+-- Boots the WebCM machine natively up to the snapshot point in webcm-init,
+-- then saves its stored configuration plus raw RAM and rootfs contents.
+--
+-- Usage: lua snapshot.lua <linux.bin> <rootfs.ext2> <output-prefix> <init>
+--
+-- The init command is WEBCM_INIT from the Makefile, the one webcm.cpp is built with.
+
+local cartesi = require("cartesi")
+
+local RAM_START <const> = 0x80000000
+local RAM_SIZE <const> = 256 * 1024 * 1024
+local ROOTFS_START <const> = 0x80000000000000
+local ROOTFS_SIZE <const> = 384 * 1024 * 1024
+local RING_START <const> = 0x90000000000000
+local RING_LENGTH <const> = 4096 + 2 * 32 * 32768 -- Must match the fetch ring layout in webcm.cpp
+local YIELD_SNAPSHOT <const> = 4 -- Must match yield_type in webcm.cpp
+
+local ram_image, rootfs_image, output_prefix, init = ...
+assert(init, "usage: lua snapshot.lua <linux.bin> <rootfs.ext2> <output-prefix> <init>")
+
+-- Same machine as webcm.cpp, except that the console is the HTIF one,
+-- because VirtIO device state is not part of a stored machine configuration.
+local machine = cartesi.machine({
+    dtb = {
+        bootargs = "quiet earlycon=sbi console=hvc0 root=/dev/pmem0 rw init=/usr/sbin/cartesi-init",
+        init = init,
+        entrypoint = "exec ash -l",
+    },
+    ram = { length = RAM_SIZE, image_filename = ram_image },
+    flash_drive = {
+        { length = ROOTFS_SIZE, image_filename = rootfs_image },
+        { start = RING_START, length = RING_LENGTH },
+    },
+    htif = { console_getchar = true },
+    processor = { iunrep = 1 },
+}, { soft_yield = true })
+
+-- Run until the guest reaches the snapshot point
+while true do
+    local break_reason = machine:run(math.maxinteger)
+    assert(break_reason == cartesi.BREAK_REASON_YIELDED_SOFTLY, "machine stopped before reaching the snapshot point")
+    -- Other yields (time, signatures, record encryption) are left unhandled, with a0 untouched,
+    -- so the guest falls back to doing the work itself instead of trusting a fake result
+    if machine:read_reg("x10") == YIELD_SNAPSHOT then
+        machine:write_reg("x10", 0) -- ret a0
+        break
+    end
+end
+print(string.format("Snapshot taken at cycle %d", machine:read_reg("mcycle")))
+
+-- Store the machine to get its full configuration, with processor and device state
+local store_dir = output_prefix .. ".tmp"
+os.execute("rm -rf " .. store_dir)
+machine:store(store_dir)
+local config_file = assert(io.open(store_dir .. "/config.json", "rb"))
+local config = config_file:read("a")
+config_file:close()
+os.execute("rm -rf " .. store_dir)
+
+-- Memory contents are shipped separately as compressed images, so drop all image references
+config = config:gsub('"image_filename"%s*:%s*"[^"]*"', '"image_filename": ""')
+local function write_file(filename, data)
+    local f = assert(io.open(filename, "wb"))
+    f:write(data)
+    f:close()
+end
+write_file(output_prefix .. "-config.json", config)
+write_file(output_prefix .. "-ram", machine:read_memory(RAM_START, RAM_SIZE))
+write_file(output_prefix .. "-rootfs", machine:read_memory(ROOTFS_START, ROOTFS_SIZE))
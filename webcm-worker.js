@@ -0,0 +1,35 @@
+// Runs the emulator in a dedicated worker, with the console bridged to the page over SharedArrayBuffer
+importScripts("https://cdn.jsdelivr.net/npm/xterm-pty@0.11.1/workerTools.js");
+
+let webcm = null;
+let timeOrigin = performance.timeOrigin; // Replaced by the page one, sent before the pty
+
+// Calls the page can make into the emulator
+const calls = {
+    bootTimings: () => JSON.parse(webcm.UTF8ToString(webcm._webcm_get_boot_timings())),
+    inputLatency: () => webcm.webcmInputLatency(),
+    runStats: () => JSON.parse(webcm.UTF8ToString(webcm._webcm_get_run_stats())),
+};
+
+onmessage = async (msg) => {
+    if (msg.data && msg.data.webcmCall) {
+        const result = webcm ? calls[msg.data.webcmCall]() : null;
+        postMessage({ webcmReply: msg.data.id, result });
+        return;
+    }
+    if (msg.data && msg.data.webcmTimeOrigin !== undefined) {
+        timeOrigin = msg.data.webcmTimeOrigin;
+        return;
+    }
+
+    // The next message carries the pty shared by TtyServer
+    const pty = new TtyClient(msg.data);
+    const { default: initEmscripten } = await import("./webcm.mjs");
+    webcm = await initEmscripten({ pty, webcmTimeOrigin: timeOrigin });
+
+    // Wall-clock budget of each emulation slice, in milliseconds
+    const sliceBudget = new URLSearchParams(location.search).get("slice");
+    if (sliceBudget) {
+        webcm._webcm_set_run_slice_budget(Number(sliceBudget));
+    }
+};
@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Must match yield_type in webcm.cpp
+enum yield_type {
+    YIELD_SNAPSHOT = 4,
+    YIELD_GET_TIME = 5,
+    YIELD_SHELL_READY = 6,
+};
+
+__attribute__((noinline, naked)) uint64_t softyield(uint64_t a0, uint64_t a1, uint64_t a2) {
+    asm volatile("sraiw x0, x31, 0\n\tret");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "snapshot") == 0) {
+        // The machine state is stored here when building a pre-booted snapshot,
+        // and execution resumes from here when the snapshot is restored
+        softyield(YIELD_SNAPSHOT, 0, 0);
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "time") == 0) {
+        // a0 is left untouched when soft yields are not handled by the host
+        const uint64_t now = softyield(YIELD_GET_TIME, 0, 0);
+        if (now == YIELD_GET_TIME) {
+            return 1;
+        }
+        printf("%llu\n", (unsigned long long)now);
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "ready") == 0) {
+        // Let the host know the shell is about to prompt for input
+        softyield(YIELD_SHELL_READY, 0, 0);
+        return 0;
+    }
+    fprintf(stderr, "Usage: webcm-yield snapshot|time|ready\n");
+    return 1;
+}
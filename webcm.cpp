@@ -11,10 +11,17 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <algorithm>
+#include <deque>
+#ifdef __EMSCRIPTEN_PTHREADS__
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 #include "cartesi-machine/machine-c-api.h"
 #include <emscripten.h>
-#include <emscripten/fetch.h>
 
 #define MINIZ_NO_ARCHIVE_APIS
 #define MINIZ_NO_STDIO
@@ -23,21 +30,177 @@
 #include "third-party/miniz.h"
 #include "third-party/miniz.c"
 
+#include "zzimage.h"
+
 #define RAM_SIZE (UINT64_C(256)*1024*1024)
 #define ROOTFS_SIZE (UINT64_C(384)*1024*1024)
 #define RAM_START UINT64_C(0x80000000)
 #define ROOTFS_START UINT64_C(0x80000000000000)
+#define ROOTFS_FILL_STEP (UINT64_C(16)*1024*1024)
+#define ROOTFS_BOOT_FILL_STEP (UINT64_C(4)*1024*1024) // Filled between run slices while the kernel boots
+#define ROOTFS_HEAD_BYTES (UINT64_C(1)*1024*1024) // Read by the kernel when it probes the drive
+#define ROOT_DELAY_S 1 // Guest seconds the kernel waits before mounting the rootfs
+#define RUN_SLICE_INITIAL_CYCLES (UINT64_C(4)*1024*1024)
+#define RUN_SLICE_MIN_CYCLES (UINT64_C(64)*1024)
+#define RUN_SLICE_MAX_CYCLES (UINT64_C(256)*1024*1024)
+#define RTC_CYCLES_PER_MS UINT64_C(128000) // Guest time advances at 128 MHz of machine cycles
+#define IDLE_SLEEP_MAX_MS 1000
+#define INPUT_BOOST_MS 300 // How long slices stay short after console input
+#define INPUT_SLICE_BUDGET_MS 1
+
+#ifndef WEBCM_INIT
+#error "WEBCM_INIT must be defined, it is shared with snapshot.lua through the Makefile"
+#endif
 
 extern "C" {
-static uint8_t linux_bin_zz[] = {
-    #embed "linux.bin.zz"
+#ifdef WEBCM_SNAPSHOT
+static uint8_t snapshot_config_json[] = {
+    #embed "snapshot-config.json"
+};
+
+static uint8_t ram_zzi[] = {
+    #embed "snapshot-ram.zzi"
+};
+
+static uint8_t rootfs_zzi[] = {
+    #embed "snapshot-rootfs.zzi"
+};
+#else
+static uint8_t ram_zzi[] = {
+    #embed "linux.bin.zzi"
 };
 
-static uint8_t rootfs_ext2_zz[] = {
-    #embed "rootfs.ext2.zz"
+static uint8_t rootfs_zzi[] = {
+    #embed "rootfs.ext2.zzi"
 };
+#endif
+}
+
+typedef struct image_env {
+    cm_machine *machine;
+    uint64_t paddr;
+    const uint8_t *data;
+    zzi_header header;
+    std::vector<zzi_extent> extents;
+    std::vector<uint8_t> buffer; // Staging buffer holding one whole inflated extent
+    uint64_t fill_cursor; // Next extent to fill, extents are filled in offset order
+} image_env;
+
+void image_open(image_env *env, cm_machine *machine, uint64_t paddr, const uint8_t *data, uint64_t size) {
+    env->machine = machine;
+    env->paddr = paddr;
+    env->data = data;
+    env->fill_cursor = 0;
+    if (size < sizeof(zzi_header)) {
+        printf("invalid image\n");
+        exit(1);
+    }
+    memcpy(&env->header, data, sizeof(zzi_header));
+    if (memcmp(env->header.magic, ZZI_MAGIC, sizeof(env->header.magic)) != 0 ||
+        env->header.extent_count > (size - sizeof(zzi_header)) / sizeof(zzi_extent)) {
+        printf("invalid image\n");
+        exit(1);
+    }
+    env->extents.resize(env->header.extent_count);
+    memcpy(env->extents.data(), data + sizeof(zzi_header), env->header.extent_count * sizeof(zzi_extent));
+    for (const zzi_extent &extent : env->extents) {
+        if (extent.data_offset > size || extent.data_length > size - extent.data_offset ||
+            extent.offset > env->header.length || extent.length > env->header.length - extent.offset ||
+            extent.length > ZZI_CHUNK_SIZE) {
+            printf("invalid image extent\n");
+            exit(1);
+        }
+    }
+    env->buffer.resize(ZZI_CHUNK_SIZE);
+}
+
+// Inflate an extent into machine memory.
+// libcartesi exposes no host pointer to its memory ranges to inflate into them in place,
+// so the extent is inflated whole into a staging buffer and copied with a single memory write.
+void image_fill_extent(image_env *env, uint64_t index) {
+    const zzi_extent &extent = env->extents[index];
+    if (tinfl_decompress_mem_to_mem(env->buffer.data(), extent.length, env->data + extent.data_offset, extent.data_length, TINFL_FLAG_PARSE_ZLIB_HEADER) != extent.length) {
+        printf("failed to uncompress image extent\n");
+        exit(1);
+    }
+    if (cm_write_memory(env->machine, env->paddr + extent.offset, env->buffer.data(), extent.length) != CM_ERROR_OK) {
+        printf("failed to write machine memory: %s\n", cm_get_last_error_message());
+        exit(1);
+    }
 }
 
+// Fill the next extents, up to about max_bytes of uncompressed data.
+// Returns true once the whole image is filled.
+bool image_fill_step(image_env *env, uint64_t max_bytes) {
+    uint64_t filled_bytes = 0;
+    for (; env->fill_cursor < env->extents.size() && filled_bytes < max_bytes; env->fill_cursor++) {
+        image_fill_extent(env, env->fill_cursor);
+        filled_bytes += env->extents[env->fill_cursor].length;
+    }
+    return env->fill_cursor == env->extents.size();
+}
+
+// Fill the next extents that start below end_offset.
+void image_fill_below(image_env *env, uint64_t end_offset) {
+    for (; env->fill_cursor < env->extents.size() && env->extents[env->fill_cursor].offset < end_offset; env->fill_cursor++) {
+        image_fill_extent(env, env->fill_cursor);
+    }
+}
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+// Fill the remaining extents, inflating them on a pool of worker threads.
+// The machine is not thread-safe, so only the calling thread writes inflated extents into its memory.
+void image_fill_parallel(image_env *env, unsigned thread_count) {
+    std::vector<uint64_t> pending;
+    for (uint64_t i = env->fill_cursor; i < env->extents.size(); i++) {
+        pending.push_back(i);
+    }
+    env->fill_cursor = env->extents.size();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<uint64_t, std::vector<uint8_t>>> inflated;
+    std::atomic<size_t> next{0};
+    const size_t max_inflated = 2 * thread_count;
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < pending.size();) {
+            const zzi_extent &extent = env->extents[pending[i]];
+            std::vector<uint8_t> buf(extent.length);
+            if (tinfl_decompress_mem_to_mem(buf.data(), buf.size(), env->data + extent.data_offset, extent.data_length, TINFL_FLAG_PARSE_ZLIB_HEADER) != extent.length) {
+                printf("failed to uncompress image extent\n");
+                exit(1);
+            }
+            // Bound memory held by inflated extents waiting to be written
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return inflated.size() < max_inflated; });
+            inflated.emplace_back(pending[i], std::move(buf));
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < thread_count; i++) {
+        threads.emplace_back(worker);
+    }
+
+    for (size_t written = 0; written < pending.size(); written++) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !inflated.empty(); });
+        auto [index, buf] = std::move(inflated.front());
+        inflated.pop_front();
+        cv.notify_all();
+        lock.unlock();
+        if (cm_write_memory(env->machine, env->paddr + env->extents[index].offset, buf.data(), buf.size()) != CM_ERROR_OK) {
+            printf("failed to write machine memory: %s\n", cm_get_last_error_message());
+            exit(1);
+        }
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+#endif
+
+#ifdef BENCH_DECOMPRESS
 typedef struct uncompress_env {
     cm_machine *machine;
     uint64_t offset;
@@ -52,198 +215,1016 @@ int uncompress_cb(uint8_t *data, int size, uncompress_env *env) {
     return 1;
 }
 
-uint64_t uncompress_memory(cm_machine *machine, uint64_t paddr, uint8_t *data, uint64_t size) {
-    uncompress_env env = {machine, paddr};
-    size_t uncompressed_size = size;
-    if (tinfl_decompress_mem_to_callback(data, &uncompressed_size, (tinfl_put_buf_func_ptr)uncompress_cb, &env, TINFL_FLAG_PARSE_ZLIB_HEADER) != 1) {
-        printf("failed to uncompress memory\n");
-        exit(1);
+// Compare inflating an image through miniz's 32 KiB callback window, one memory write per window,
+// against inflating whole extents into a staging buffer, one memory write per extent.
+static void bench_decompress(cm_machine *machine, uint64_t paddr, const uint8_t *data, uint64_t size) {
+    image_env env;
+    image_open(&env, machine, paddr, data, size);
+    uint64_t total_bytes = 0;
+    for (const zzi_extent &extent : env.extents) {
+        total_bytes += extent.length;
+    }
+    const double total_mib = static_cast<double>(total_bytes) / (1024*1024);
+
+    double start = emscripten_get_now();
+    for (const zzi_extent &extent : env.extents) {
+        uncompress_env uenv = {machine, paddr + extent.offset};
+        size_t data_length = extent.data_length;
+        if (tinfl_decompress_mem_to_callback(data + extent.data_offset, &data_length, (tinfl_put_buf_func_ptr)uncompress_cb, &uenv, TINFL_FLAG_PARSE_ZLIB_HEADER) != 1) {
+            printf("failed to uncompress image extent\n");
+            exit(1);
+        }
+    }
+    const double callback_ms = emscripten_get_now() - start;
+
+    start = emscripten_get_now();
+    image_fill_step(&env, UINT64_MAX);
+    const double staged_ms = emscripten_get_now() - start;
+
+    printf("Decompressed %.1f MiB\n", total_mib);
+    printf("callback: %8.1f ms %8.1f MiB/s\n", callback_ms, total_mib * 1000 / callback_ms);
+    printf("staged:   %8.1f ms %8.1f MiB/s\n", staged_ms, total_mib * 1000 / staged_ms);
+}
+#endif
+
+enum class boot_phase : int {
+    INSTANTIATE = 0,
+    CREATE,
+    KERNEL_DECOMPRESS,
+    ROOTFS_DECOMPRESS,
+    FIRST_RUN,
+    SHELL_READY,
+    COUNT,
+};
+
+struct boot_timing final {
+    const char *name;
+    double time_ms{-1}; // Monotonic time at which the phase ended, relative to page load
+    uint64_t mcycle{0}; // Machine cycle at which the phase ended
+};
+
+static boot_timing boot_timings[static_cast<int>(boot_phase::COUNT)] = {
+    {"instantiate"},
+    {"create"},
+    {"kernel_decompress"},
+    {"rootfs_decompress"},
+    {"first_run"},
+    {"shell_ready"},
+};
+
+// Milliseconds since the page loaded. A worker clock starts when the worker does, so the page passes
+// its own time origin along when running the emulator in one.
+EM_JS(double, get_page_time_ms, (), {
+    const origin = Module["webcmTimeOrigin"] !== undefined ? Module["webcmTimeOrigin"] : performance.timeOrigin;
+    return performance.timeOrigin + performance.now() - origin;
+});
+
+static void record_boot_phase(boot_phase phase, cm_machine *machine) {
+    boot_timing &timing = boot_timings[static_cast<int>(phase)];
+    if (timing.time_ms >= 0) {
+        return;
+    }
+    timing.time_ms = get_page_time_ms();
+    if (machine) {
+        cm_read_reg(machine, CM_REG_MCYCLE, &timing.mcycle);
+    }
+}
+
+// Return boot phase timings as a JSON object, phases not reached yet are null.
+extern "C" EMSCRIPTEN_KEEPALIVE const char *webcm_get_boot_timings() {
+    static std::string json;
+    json = "{";
+    for (const boot_timing &timing : boot_timings) {
+        char entry[128];
+        if (timing.time_ms >= 0) {
+            snprintf(entry, sizeof(entry), "\"%s\":{\"time_ms\":%.3f,\"mcycle\":%llu}", timing.name, timing.time_ms, static_cast<unsigned long long>(timing.mcycle));
+        } else {
+            snprintf(entry, sizeof(entry), "\"%s\":null", timing.name);
+        }
+        if (json.size() > 1) {
+            json += ",";
+        }
+        json += entry;
+    }
+    json += "}";
+    return json.c_str();
+}
+
+// Wall-clock time each run slice should take before yielding to the browser
+static double run_slice_budget_ms = 10;
+
+extern "C" EMSCRIPTEN_KEEPALIVE void webcm_set_run_slice_budget(double budget_ms) {
+    if (budget_ms > 0) {
+        run_slice_budget_ms = budget_ms;
+    }
+}
+
+// Guest throughput counters, to benchmark build variants against each other
+struct run_stats final {
+    uint64_t busy_cycles{0}; // Cycles actually interpreted, excluding idle fast-forwards
+    double busy_ms{0}; // Host time spent interpreting them
+};
+
+static run_stats stats;
+
+// Return guest throughput as a JSON object, MIPS is measured over busy slices only.
+extern "C" EMSCRIPTEN_KEEPALIVE const char *webcm_get_run_stats() {
+    static char json[128];
+    const double mips = stats.busy_ms > 0 ? static_cast<double>(stats.busy_cycles) / (stats.busy_ms * 1000.0) : 0;
+    snprintf(json, sizeof(json), "{\"busy_cycles\":%llu,\"busy_ms\":%.3f,\"mips\":%.3f}",
+        static_cast<unsigned long long>(stats.busy_cycles), stats.busy_ms, mips);
+    return json;
+}
+
+struct run_quantum final {
+    double cycles_per_ms{0}; // Moving average of the emulation throughput
+    uint64_t slice_cycles{RUN_SLICE_INITIAL_CYCLES};
+};
+
+// Update throughput with the last slice and size the next slice to the wall-clock budget.
+// Only busy cycles count, idle cycles fast-forwarded by the interpreter take no host time.
+static void update_run_quantum(run_quantum &quantum, uint64_t busy_cycles, double elapsed_ms) {
+    // Slices too short to time reliably carry no throughput information
+    if (busy_cycles > 0 && elapsed_ms >= 0.5) {
+        const double cycles_per_ms = static_cast<double>(busy_cycles) / elapsed_ms;
+        quantum.cycles_per_ms = quantum.cycles_per_ms > 0 ? 0.75 * quantum.cycles_per_ms + 0.25 * cycles_per_ms : cycles_per_ms;
+    }
+    if (quantum.cycles_per_ms > 0) {
+        // Grow at most 2x per slice
+        double target = std::min(quantum.cycles_per_ms * run_slice_budget_ms, 2.0 * static_cast<double>(quantum.slice_cycles));
+        // Shrink right away when the last slice went over budget
+        if (elapsed_ms > run_slice_budget_ms) {
+            target = std::min(target, static_cast<double>(quantum.slice_cycles) * run_slice_budget_ms / elapsed_ms);
+        }
+        quantum.slice_cycles = std::clamp(static_cast<uint64_t>(target), RUN_SLICE_MIN_CYCLES, RUN_SLICE_MAX_CYCLES);
     }
-    return uncompressed_size;
 }
 
+// Sleep up to timeout_ms, waking up early on host events the guest must react to,
+// such as console input or a completed fetch.
+EM_ASYNC_JS(void, wait_host_event, (double timeout_ms), {
+    const pty = Module["pty"];
+    if (Module["webcmWakePending"] || (pty && pty.readable)) {
+        Module["webcmWakePending"] = false;
+        return;
+    }
+    await new Promise((resolve) => {
+        const wake = () => {
+            clearTimeout(timer);
+            Module["webcmWake"] = null;
+            resolve();
+        };
+        const timer = setTimeout(wake, timeout_ms);
+        Module["webcmWake"] = wake;
+    });
+});
+
+// Track console input and output, to wake the host on input and to measure keypress-to-echo latency.
+EM_JS(void, listen_console, (), {
+    const pty = Module["pty"];
+    if (!pty) {
+        return;
+    }
+    const latencies = [];
+    let pending_input = null;
+    Module["webcmLastInput"] = -Infinity;
+    if (typeof pty.onReadable === "function") {
+        pty.onReadable(() => {
+            const now = performance.now();
+            Module["webcmLastInput"] = now;
+            if (pending_input === null) {
+                pending_input = now;
+            }
+            if (Module["webcmWake"]) {
+                Module["webcmWake"]();
+            }
+        });
+    }
+    const write = pty.write.bind(pty);
+    pty.write = (...args) => {
+        if (pending_input !== null) {
+            latencies.push(performance.now() - pending_input);
+            if (latencies.length > 1024) {
+                latencies.shift();
+            }
+            pending_input = null;
+        }
+        return write(...args);
+    };
+    Module["webcmInputLatency"] = () => {
+        const sorted = latencies.slice().sort((a, b) => a - b);
+        const percentile = (p) => sorted.length > 0 ? sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))] : null;
+        return { samples: sorted.length, p50_ms: percentile(0.5), p99_ms: percentile(0.99) };
+    };
+});
+
+// Milliseconds since the last console input.
+EM_JS(double, get_input_age_ms, (), {
+    return performance.now() - Module["webcmLastInput"];
+});
+
 enum class yield_type : uint64_t {
     INVALID = 0,
-    REQUEST,
-    POLL_RESPONSE,
-    POLL_RESPONSE_BODY,
+    REQUEST, // Retired, network operations go through the fetch ring
+    POLL_RESPONSE, // Retired
+    POLL_RESPONSE_BODY, // Retired
+    SNAPSHOT,
+    GET_TIME,
+    SHELL_READY,
+    SIGN, // a1 points to a yield_sign
+    ENCRYPT, // a1 points to a yield_encrypt
+};
+
+// Result of a fetch ring completion
+enum class yield_result : uint32_t {
+    OK = 0,
+    FAILED,
+};
+
+// Network payloads are length-prefixed records, versioned so guest and host can detect a mismatch.
+// Strings are not NUL terminated, each header is a yield_field followed by its name and value bytes.
+static constexpr uint32_t YIELD_WIRE_VERSION = 3;
+static constexpr uint64_t YIELD_INLINE_BODY_MAX = 16384; // Body bytes up to this size travel inside the payload
+
+struct yield_field final {
+    uint32_t name_length{0};
+    uint32_t value_length{0};
+};
+
+// REQUEST payload, followed by the method, url, header fields and inline body
+struct yield_req final {
+    uint32_t version{YIELD_WIRE_VERSION};
+    uint32_t length{0}; // Encoded length, including this header
+    uint32_t method_length{0};
+    uint32_t url_length{0};
+    uint32_t headers_count{0};
+    uint32_t inline_body_length{0};
+    uint64_t body_length{0}; // Body staged by REQUEST_BODY entries when too large to inline
 };
 
-struct yield_mmio_req final {
-    uint64_t headers_count{0};
-    uint64_t body_vaddr{0};
-    uint64_t body_length{0};
-    char url[4096]{};
-    char method[32]{};
-    char headers[64][2][256]{};
+// REQUEST completion payload, sent once the response headers arrive,
+// followed by the header fields and the leading body bytes already received
+struct yield_res final {
+    uint32_t version{YIELD_WIRE_VERSION};
+    uint32_t length{0}; // Encoded length, including this header
+    uint32_t headers_count{0};
+    uint32_t inline_body_length{0};
+    uint32_t status{0};
+    uint32_t body_done{0}; // Nonzero when the inline bytes are the whole body
 };
 
-struct yield_mmio_res final {
-    uint64_t ready_state{0};
-    uint64_t status{0};
-    uint64_t body_total_length{0};
-    uint64_t headers_count{0};
-    char headers[64][2][256]{};
+template <class T>
+static void append_pod(std::string &buf, const T &value) {
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(value)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+// Sequential reader over a yield payload, reads past its end fail
+struct payload_reader final {
+    std::string_view data;
+
+    bool read(std::string_view &out, size_t length) {
+        if (length > data.length()) {
+            return false;
+        }
+        out = data.substr(0, length);
+        data.remove_prefix(length);
+        return true;
+    }
+
+    template <class T>
+    bool read(T &out) {
+        std::string_view bytes;
+        if (!read(bytes, sizeof(T))) {
+            return false;
+        }
+        memcpy(&out, bytes.data(), sizeof(T));
+        return true;
+    }
+};
+
+// Fetch ring, a flash drive shared by guest and host for batched network operations.
+// Layout must match https-proxy/fetch_ring.hpp.
+static constexpr uint32_t RING_VERSION = 1;
+static constexpr uint64_t RING_START = UINT64_C(0x90000000000000);
+static constexpr uint64_t RING_BLOCK_SIZE = 512;
+static constexpr uint64_t RING_ENTRIES = 32;
+static constexpr uint64_t RING_SLOT_SIZE = 32768;
+static constexpr uint64_t RING_GUEST_CTL_OFFSET = 0;
+static constexpr uint64_t RING_HOST_CTL_OFFSET = RING_BLOCK_SIZE;
+static constexpr uint64_t RING_SQ_OFFSET = 4096;
+static constexpr uint64_t RING_CQ_OFFSET = RING_SQ_OFFSET + RING_ENTRIES * RING_SLOT_SIZE;
+static constexpr uint64_t RING_LENGTH = RING_CQ_OFFSET + RING_ENTRIES * RING_SLOT_SIZE;
+
+enum class ring_op : uint32_t {
+    NOP = 0,
+    REQUEST, // Payload is a yield_req, completes when the response headers arrive
+    REQUEST_BODY, // Payload is appended to the staged request body, no completion
+    READ_BODY, // Payload is a ring_read, completes with the next body bytes, none at the end
+    CLOSE, // Release the fetch, pending reads complete as failed
 };
 
+struct ring_ctl final {
+    uint32_t version{RING_VERSION};
+    uint32_t sq_index{0}; // Guest: submission tail, host: submission head
+    uint32_t cq_index{0}; // Guest: completion head, host: completion tail
+};
+
+struct ring_entry final {
+    uint32_t op{0};
+    uint32_t result{0}; // yield_result of a completion
+    uint64_t uid{0};
+    uint32_t length{0}; // Payload length following this header
+    uint32_t reserved{0};
+};
+
+struct ring_read final {
+    uint64_t length{0}; // Maximum bytes to return
+};
+
+static constexpr uint64_t RING_PAYLOAD_MAX = RING_SLOT_SIZE - sizeof(ring_entry);
+
+// Browser fetch bridge. Response bodies are read as streams into a bounded queue,
+// that the host drains as the guest asks for them, so large downloads never sit fully in memory.
+EM_JS(void, js_fetch_start, (int handle, const char *method, const char *url, const char *headers, const char *body, size_t body_length), {
+    const FETCH_BUFFER_MAX = 1048576; // Stop reading the network while this much is queued
+    if (!Module["webcmFetches"]) {
+        Module["webcmFetches"] = new Map();
+        Module["webcmFetchEvents"] = [];
+    }
+    const f = { status: 0, headers: "", chunks: [], buffered: 0, done: false, failed: false, resume: null, controller: new AbortController() };
+    Module["webcmFetches"].set(handle, f);
+    const uploads = Module["webcmUploads"];
+    let reported = false;
+    const notify = (ready) => {
+        if (ready && !reported) {
+            reported = true;
+            Module["webcmFetchEvents"].push(handle);
+        }
+        if (Module["webcmWake"]) {
+            Module["webcmWake"]();
+        } else {
+            Module["webcmWakePending"] = true;
+        }
+    };
+    const init = { method: UTF8ToString(method), headers: [], signal: f.controller.signal };
+    for (const line of UTF8ToString(headers).split("\r\n")) {
+        const colon = line.indexOf(": ");
+        if (colon > 0) {
+            init.headers.push([line.slice(0, colon), line.slice(colon + 2)]);
+        }
+    }
+    if (uploads && uploads.has(handle)) {
+        init.body = new Blob(uploads.get(handle));
+        uploads.delete(handle);
+    } else if (body_length > 0) {
+        init.body = HEAPU8.slice(body, body + body_length);
+    }
+    (async () => {
+        try {
+            const res = await fetch(UTF8ToString(url), init);
+            f.status = res.status;
+            f.headers = Array.from(res.headers, ([name, value]) => name + ": " + value).join("\r\n");
+            // Report headers right away, streamed responses may not send body bytes for a long time
+            notify(true);
+            const reader = res.body ? res.body.getReader() : null;
+            while (reader) {
+                if (f.buffered >= FETCH_BUFFER_MAX) {
+                    await new Promise((resolve) => { f.resume = resolve; });
+                }
+                const { done, value } = await reader.read();
+                if (done) {
+                    break;
+                }
+                f.chunks.push(value);
+                f.buffered += value.length;
+                notify(false);
+            }
+            f.done = true;
+        } catch (e) {
+            f.failed = true;
+        }
+        notify(true);
+    })();
+});
+
+// Stage a chunk of a request body too large to inline, as Blob parts the browser may keep out of memory.
+EM_JS(void, js_fetch_stage, (int handle, const char *data, size_t length), {
+    if (!Module["webcmUploads"]) {
+        Module["webcmUploads"] = new Map();
+    }
+    const uploads = Module["webcmUploads"];
+    const parts = uploads.get(handle) || [];
+    parts.push(HEAPU8.slice(data, data + length));
+    // Fold parts into a single Blob every so often, so only a few chunks stay as plain copies
+    uploads.set(handle, parts.length >= 32 ? [new Blob(parts)] : parts);
+});
+
+// Next fetch whose response headers arrived or that failed, -1 when none.
+EM_JS(int, js_fetch_next_event, (), {
+    const events = Module["webcmFetchEvents"];
+    return events && events.length > 0 ? events.shift() : -1;
+});
+
+// Response status, 0 when the fetch failed.
+EM_JS(int, js_fetch_status, (int handle), {
+    const f = Module["webcmFetches"].get(handle);
+    return f && !f.failed ? f.status : 0;
+});
+
+EM_JS(size_t, js_fetch_headers_length, (int handle), {
+    return lengthBytesUTF8(Module["webcmFetches"].get(handle).headers);
+});
+
+// Copy response headers as "name: value" lines separated by CRLF.
+EM_JS(void, js_fetch_headers, (int handle, char *buf, size_t size), {
+    stringToUTF8(Module["webcmFetches"].get(handle).headers, buf, size);
+});
+
+// Take up to size queued body bytes, returns 0 when none arrived yet, -1 at the end of the body and -2 on failure.
+EM_JS(int, js_fetch_read, (int handle, char *buf, size_t size), {
+    const f = Module["webcmFetches"].get(handle);
+    if (!f) {
+        return -2;
+    }
+    let n = 0;
+    while (n < size && f.chunks.length > 0) {
+        const chunk = f.chunks[0];
+        const take = Math.min(chunk.length, size - n);
+        HEAPU8.set(chunk.subarray(0, take), buf + n);
+        n += take;
+        if (take === chunk.length) {
+            f.chunks.shift();
+        } else {
+            f.chunks[0] = chunk.subarray(take);
+        }
+    }
+    f.buffered -= n;
+    if (f.resume) {
+        f.resume();
+        f.resume = null;
+    }
+    if (n > 0) {
+        return n;
+    }
+    return f.failed ? -2 : (f.done ? -1 : 0);
+});
+
+EM_JS(void, js_fetch_close, (int handle), {
+    if (Module["webcmUploads"]) {
+        Module["webcmUploads"].delete(handle);
+    }
+    const f = Module["webcmFetches"] && Module["webcmFetches"].get(handle);
+    if (f) {
+        f.controller.abort();
+        if (f.resume) {
+            f.resume();
+        }
+        Module["webcmFetches"].delete(handle);
+    }
+});
+
 struct fetch_object final {
     uint64_t uid{0};
-    emscripten_fetch_t *fetch{nullptr};
-    std::string body;
-    bool done{false};
+    int handle{0}; // Browser fetch bridge handle, 0 until the body is staged or the fetch started
+    uint64_t staged_length{0}; // Request body bytes staged by REQUEST_BODY entries
+    bool started{false};
+    std::deque<uint64_t> pending_reads; // READ_BODY lengths waiting for data
 };
 
 static std::unordered_map<uint64_t, std::unique_ptr<fetch_object>> fetches;
+static std::unordered_map<int, uint64_t> fetch_handles; // Bridge handle to fetch uid
+static int next_fetch_handle = 1;
+static std::deque<std::string> ring_completions; // Encoded completions waiting for a free slot
+static ring_ctl ring_host_ctl;
+
+static void close_fetch(uint64_t uid) {
+    auto it = fetches.find(uid);
+    if (it != fetches.end()) {
+        if (it->second->handle != 0) {
+            js_fetch_close(it->second->handle);
+            fetch_handles.erase(it->second->handle);
+        }
+        fetches.erase(it);
+    }
+}
 
-template <size_t N>
-static void strsvcopy(char (&dest)[N], std::string_view sv) {
-    memcpy(dest, sv.data(), std::min(sv.length(), N));
-    dest[std::min(sv.length(), N - 1)] = 0;
+static void post_completion(ring_op op, uint64_t uid, yield_result result, std::string_view payload = {}) {
+    ring_entry entry;
+    entry.op = static_cast<uint32_t>(op);
+    entry.result = static_cast<uint32_t>(result);
+    entry.uid = uid;
+    entry.length = payload.length();
+    std::string slot;
+    slot.reserve(sizeof(entry) + payload.length());
+    append_pod(slot, entry);
+    slot.append(payload);
+    ring_completions.push_back(std::move(slot));
 }
 
-static void on_fetch_success(emscripten_fetch_t *fetch) {
-    fetch_object *o = reinterpret_cast<fetch_object*>(fetch->userData);
-    o->done = true;
+// Start the fetch of a REQUEST entry, its body is inline or was staged by REQUEST_BODY entries
+static bool start_fetch(fetch_object &o, std::string_view payload) {
+    yield_req req_header;
+    payload_reader reader{payload};
+    if (!reader.read(req_header) || req_header.version != YIELD_WIRE_VERSION || req_header.length != payload.length()) {
+        return false;
+    }
+    std::string_view method;
+    std::string_view url;
+    std::string_view inline_body;
+    std::string headers;
+    bool valid = reader.read(method, req_header.method_length) && reader.read(url, req_header.url_length);
+    for (uint32_t i = 0; valid && i < req_header.headers_count; i++) {
+        yield_field field;
+        std::string_view name;
+        std::string_view value;
+        valid = reader.read(field) && reader.read(name, field.name_length) && reader.read(value, field.value_length);
+        headers.append(name).append(": ").append(value).append("\r\n");
+    }
+    valid = valid && reader.read(inline_body, req_header.inline_body_length) &&
+        o.staged_length == req_header.body_length && (inline_body.empty() || o.staged_length == 0);
+    if (!valid) {
+        printf("malformed request payload\n");
+        return false;
+    }
+
+    // The bridge copies an inline body, a staged one is already on its side
+    if (o.handle == 0) {
+        o.handle = next_fetch_handle++;
+        fetch_handles[o.handle] = o.uid;
+    }
+    o.started = true;
+    js_fetch_start(o.handle, std::string(method).c_str(), std::string(url).c_str(), headers.c_str(), inline_body.data(), inline_body.size());
+    return true;
 }
 
-static void on_fetch_error(emscripten_fetch_t *fetch) {
-    fetch_object *o = reinterpret_cast<fetch_object*>(fetch->userData);
-    o->done = true;
+// Encode the REQUEST completion of a fetch whose headers arrived, with the body bytes received so far.
+// Sets finished when they are the whole body, so the guest needs nothing more from the fetch.
+static bool encode_response(const fetch_object &o, std::string &payload, bool &finished) {
+    const int status = js_fetch_status(o.handle);
+    if (status == 0) {
+        return false;
+    }
+
+    // Set response headers
+    std::string headers_str(js_fetch_headers_length(o.handle) + 1, '\x0');
+    js_fetch_headers(o.handle, headers_str.data(), headers_str.size());
+    headers_str.back() = '\n';
+    std::string fields;
+    uint32_t headers_count = 0;
+    for (size_t pos = 0; ; ) {
+        const size_t end = headers_str.find('\n', pos);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::string_view line(headers_str.data() + pos, end - pos);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        const auto colon_pos = line.find(": ");
+        if (colon_pos != std::string_view::npos) {
+            const std::string_view name = line.substr(0, colon_pos);
+            const std::string_view value = line.substr(colon_pos + 2);
+            append_pod(fields, yield_field{static_cast<uint32_t>(name.length()), static_cast<uint32_t>(value.length())});
+            fields.append(name).append(value);
+            headers_count++;
+        }
+        pos = end + 1;
+    }
+    if (sizeof(yield_res) + fields.size() > RING_PAYLOAD_MAX) {
+        printf("response headers too large\n");
+        return false;
+    }
+
+    // Take the leading body bytes that fit
+    std::string body(std::min(YIELD_INLINE_BODY_MAX, RING_PAYLOAD_MAX - sizeof(yield_res) - fields.size()), '\x0');
+    size_t body_length = 0;
+    int n = 0;
+    while (body_length < body.size() && (n = js_fetch_read(o.handle, body.data() + body_length, body.size() - body_length)) > 0) {
+        body_length += n;
+    }
+    if (n == -2) {
+        return false;
+    }
+
+    // Set response
+    yield_res res_header;
+    res_header.headers_count = headers_count;
+    res_header.status = status;
+    res_header.inline_body_length = body_length;
+    res_header.body_done = n == -1 ? 1 : 0;
+    res_header.length = sizeof(res_header) + fields.size() + body_length;
+    payload.reserve(res_header.length);
+    append_pod(payload, res_header);
+    payload.append(fields);
+    payload.append(body.data(), body_length);
+    finished = res_header.body_done != 0;
+    return true;
 }
 
-bool handle_softyield(cm_machine *machine) {
-    uint64_t type = 0;
-    uint64_t uid = 0;
-    uint64_t vaddr = 0;
-    cm_read_reg(machine, CM_REG_X10, &type); // a0
-    cm_read_reg(machine, CM_REG_X11, &uid); // a1
-    cm_read_reg(machine, CM_REG_X12, &vaddr); // a2
+// Complete READ_BODY entries of a fetch for as long as body bytes are available
+static void serve_body_reads(fetch_object &o, std::string &buf) {
+    while (!o.pending_reads.empty()) {
+        buf.resize(std::min(o.pending_reads.front(), RING_PAYLOAD_MAX));
+        const int n = js_fetch_read(o.handle, buf.data(), buf.size());
+        if (n == 0) {
+            break;
+        }
+        o.pending_reads.pop_front();
+        if (n == -2) {
+            post_completion(ring_op::READ_BODY, o.uid, yield_result::FAILED);
+        } else {
+            post_completion(ring_op::READ_BODY, o.uid, yield_result::OK, std::string_view(buf.data(), std::max(n, 0)));
+        }
+    }
+}
 
-    switch (static_cast<yield_type>(type)) {
-        case yield_type::REQUEST: {
-            // Read request data
-            yield_mmio_req mmio_req;
-            if (cm_read_virtual_memory(machine, vaddr, (uint8_t*)(&mmio_req), sizeof(mmio_req)) != 0) {
-                printf("failed to read virtual memory: %s\n", cm_get_last_error_message());
-                return false;
+static void handle_ring_submission(const ring_entry &entry, std::string_view payload) {
+    const uint64_t uid = entry.uid;
+    switch (static_cast<ring_op>(entry.op)) {
+        case ring_op::REQUEST_BODY: {
+            auto &o = fetches[uid];
+            if (!o) {
+                o = std::make_unique<fetch_object>();
+                o->uid = uid;
             }
-
-            if (fetches.find(uid) != fetches.end()) {
-                return true;
+            if (o->started) {
+                printf("request body staged after its request\n");
+                break;
             }
-
-            // Set headers
-            std::vector<const char*> headers;
-            for (uint64_t i = 0; i < mmio_req.headers_count; i++) {
-                headers.push_back(mmio_req.headers[i][0]);
-                headers.push_back(mmio_req.headers[i][1]);
+            if (o->handle == 0) {
+                o->handle = next_fetch_handle++;
+                fetch_handles[o->handle] = uid;
             }
-            headers.push_back(nullptr);
-
-            // Set fetch attributes
-            auto o = std::make_unique<fetch_object>();
-            emscripten_fetch_attr_t attr;
-            emscripten_fetch_attr_init(&attr);
-            attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
-            attr.timeoutMSecs = 0;
-            attr.requestHeaders = headers.data();
-            attr.onsuccess = on_fetch_success;
-            attr.onerror = on_fetch_error;
-            attr.userData = reinterpret_cast<void*>(o.get());
-            if (mmio_req.body_length > 0) {
-                o->body.resize(mmio_req.body_length);
-                // Write attr.requestData by reading mmio_req.body_vaddr from machine memory
-                if (cm_read_virtual_memory(machine, mmio_req.body_vaddr, reinterpret_cast<uint8_t*>(o->body.data()), mmio_req.body_length) != 0) {
-                    printf("failed to read virtual memory: %s\n", cm_get_last_error_message());
-                    return false;
-                }
-                attr.requestData = reinterpret_cast<const char*>(o->body.data());
-                attr.requestDataSize = o->body.size();
+            js_fetch_stage(o->handle, payload.data(), payload.size());
+            o->staged_length += payload.size();
+            break;
+        }
+        case ring_op::REQUEST: {
+            auto &o = fetches[uid];
+            if (!o) {
+                o = std::make_unique<fetch_object>();
+                o->uid = uid;
+            }
+            if (o->started || !start_fetch(*o, payload)) {
+                post_completion(ring_op::REQUEST, uid, yield_result::FAILED);
+                close_fetch(uid);
             }
-            strcpy(attr.requestMethod, mmio_req.method);
-
-            // Initiate fetch
-            o->fetch = emscripten_fetch(&attr, mmio_req.url);
-            fetches[uid] = std::move(o);
             break;
         }
-        case yield_type::POLL_RESPONSE: {
-            // Retrieve fetch
+        case ring_op::READ_BODY: {
             auto it = fetches.find(uid);
-            if (it == fetches.end()) {
-                printf("failed to retrieve fetch\n");
-                return true;
+            ring_read read;
+            payload_reader reader{payload};
+            if (it == fetches.end() || !it->second->started || !reader.read(read)) {
+                post_completion(ring_op::READ_BODY, uid, yield_result::FAILED);
+                break;
             }
-            auto& o = it->second;
-            emscripten_fetch_t *fetch = o->fetch;
-
-            // Wait fetch to complete
-            while (!o->done) {
-                emscripten_sleep(4);
-            }
-
-            // Set response
-            yield_mmio_res mmio_res;
-            mmio_res.ready_state = fetch->readyState;
-            mmio_res.status = fetch->status;
-            mmio_res.body_total_length = fetch->totalBytes;
-
-            // Set response headers
-            std::string headers_str(emscripten_fetch_get_response_headers_length(fetch) + 1, '\x0');
-            emscripten_fetch_get_response_headers(fetch, headers_str.data(), headers_str.size());
-            mmio_res.headers_count = 0;
-            for (size_t pos = 0; mmio_res.headers_count < 64; ) {
-                const size_t end = headers_str.find('\n', pos);
-                if (end == std::string::npos || end == pos) {
-                    break;
-                }
-                std::string_view line(headers_str.data() + pos, end - pos);
-                if (line.back() == '\r') {
-                    line.remove_suffix(1);
-                }
-                const auto colon_pos = line.find(": ");
-                if (colon_pos != std::string_view::npos) {
-                    strsvcopy(mmio_res.headers[mmio_res.headers_count][0], line.substr(0, colon_pos));
-                    strsvcopy(mmio_res.headers[mmio_res.headers_count][1], line.substr(colon_pos + 2));
-                    mmio_res.headers_count++;
+            it->second->pending_reads.push_back(read.length);
+            break;
+        }
+        case ring_op::CLOSE: {
+            // Reads left pending still complete, so the guest can account for every one it posted
+            auto it = fetches.find(uid);
+            if (it != fetches.end()) {
+                for (size_t i = 0; i < it->second->pending_reads.size(); ++i) {
+                    post_completion(ring_op::READ_BODY, uid, yield_result::FAILED);
                 }
-                pos = end + 1;
             }
+            close_fetch(uid);
+            break;
+        }
+        default:
+            printf("invalid fetch ring operation\n");
+            break;
+    }
+}
 
-            // Write response
-            if (cm_write_virtual_memory(machine, vaddr, (uint8_t*)(&mmio_res), sizeof(mmio_res)) != 0) {
-                printf("failed to write virtual memory: %s\n", cm_get_last_error_message());
-                return false;
-            }
+// Drain fetch ring submissions and post completions, with physical memory accesses only.
+// Sets progress when completions were posted, so the guest should run again right away.
+static bool process_fetch_ring(cm_machine *machine, bool &progress) {
+    ring_ctl guest_ctl;
+    if (cm_read_memory(machine, RING_START + RING_GUEST_CTL_OFFSET, reinterpret_cast<uint8_t*>(&guest_ctl), sizeof(guest_ctl)) != CM_ERROR_OK) {
+        printf("failed to read fetch ring: %s\n", cm_get_last_error_message());
+        return false;
+    }
+    if (guest_ctl.version != RING_VERSION) {
+        return true; // The guest is not attached yet
+    }
+    const ring_ctl last_host_ctl = ring_host_ctl;
+
+    // Drain submissions, a guest further ahead than the ring size is out of sync and skipped
+    if (guest_ctl.sq_index - ring_host_ctl.sq_index > RING_ENTRIES) {
+        printf("fetch ring out of sync\n");
+        ring_host_ctl.sq_index = guest_ctl.sq_index;
+    }
+    std::string slot;
+    while (ring_host_ctl.sq_index != guest_ctl.sq_index) {
+        const uint64_t paddr = RING_START + RING_SQ_OFFSET + (ring_host_ctl.sq_index % RING_ENTRIES) * RING_SLOT_SIZE;
+        ring_entry entry;
+        if (cm_read_memory(machine, paddr, reinterpret_cast<uint8_t*>(&entry), sizeof(entry)) != CM_ERROR_OK) {
+            printf("failed to read fetch ring: %s\n", cm_get_last_error_message());
+            return false;
+        }
+        slot.resize(std::min(entry.length, static_cast<uint32_t>(RING_PAYLOAD_MAX)));
+        if (cm_read_memory(machine, paddr + sizeof(entry), reinterpret_cast<uint8_t*>(slot.data()), slot.size()) != CM_ERROR_OK) {
+            printf("failed to read fetch ring: %s\n", cm_get_last_error_message());
+            return false;
+        }
+        handle_ring_submission(entry, slot);
+        ring_host_ctl.sq_index++;
+    }
+
+    // Complete requests whose response headers arrived
+    for (int handle; (handle = js_fetch_next_event()) >= 0; ) {
+        const auto handle_it = fetch_handles.find(handle);
+        if (handle_it == fetch_handles.end()) {
+            continue;
+        }
+        const uint64_t uid = handle_it->second;
+        std::string payload;
+        bool finished = false;
+        if (!encode_response(*fetches[uid], payload, finished)) {
+            post_completion(ring_op::REQUEST, uid, yield_result::FAILED);
+            close_fetch(uid);
+            continue;
+        }
+        post_completion(ring_op::REQUEST, uid, yield_result::OK, payload);
+        if (finished) {
+            close_fetch(uid);
+        }
+    }
+
+    // Hand over body bytes that arrived to waiting reads
+    for (auto &[uid, o] : fetches) {
+        serve_body_reads(*o, slot);
+    }
+
+    // Post completions while the guest has room for them
+    while (!ring_completions.empty() && ring_host_ctl.cq_index - guest_ctl.cq_index < RING_ENTRIES) {
+        const std::string &completion = ring_completions.front();
+        const uint64_t paddr = RING_START + RING_CQ_OFFSET + (ring_host_ctl.cq_index % RING_ENTRIES) * RING_SLOT_SIZE;
+        if (cm_write_memory(machine, paddr, reinterpret_cast<const uint8_t*>(completion.data()), completion.size()) != CM_ERROR_OK) {
+            printf("failed to write fetch ring: %s\n", cm_get_last_error_message());
+            return false;
+        }
+        ring_completions.pop_front();
+        ring_host_ctl.cq_index++;
+        progress = true;
+    }
+
+    if (memcmp(&last_host_ctl, &ring_host_ctl, sizeof(ring_host_ctl)) != 0 &&
+        cm_write_memory(machine, RING_START + RING_HOST_CTL_OFFSET, reinterpret_cast<const uint8_t*>(&ring_host_ctl), sizeof(ring_host_ctl)) != CM_ERROR_OK) {
+        printf("failed to write fetch ring: %s\n", cm_get_last_error_message());
+        return false;
+    }
+    return true;
+}
+
+// SIGN request from the guest proxy, which offloads its certificate key signatures.
+// Layout must match https-proxy/sign_offload.hpp.
+static constexpr uint32_t YIELD_SIGN_VERSION = 1;
+
+enum class sign_algorithm : uint32_t {
+    ECDSA_P256 = 1, // Digest truncated to 32 bytes, signature is r then s, 32 bytes each big endian
+};
+
+struct yield_sign final {
+    uint32_t version{YIELD_SIGN_VERSION};
+    uint32_t algorithm{0};
+    uint32_t digest_length{0};
+    uint32_t signature_length{0}; // Filled by the host
+    uint8_t key[32]{}; // Private scalar, big endian
+    uint8_t digest[64]{};
+    uint8_t signature[64]{};
+};
 
-            // Free
-            if (mmio_res.body_total_length == 0) {
-                emscripten_fetch_close(fetch);
-                fetches.erase(it);
+// ECDSA P-256 signature of a digest with BigInt arithmetic, WebCrypto only signs whole messages.
+// Not constant time, the key is the local MITM key the guest hands over anyway. Returns 0 on failure.
+EM_JS(int, js_ecdsa_p256_sign, (const uint8_t *key, const uint8_t *digest, uint32_t digest_length, uint8_t *signature), {
+    const p = 0xffffffff00000001000000000000000000000000ffffffffffffffffffffffffn;
+    const n = 0xffffffff00000000ffffffffffffffffbce6faada7179e84f3b9cac2fc632551n;
+    const gx = 0x6b17d1f2e12c4247f8bce6e563a440f277037d812deb33a0f4a13945d898c296n;
+    const gy = 0x4fe342e2fe1a7f9b8ee7eb4a7c0f9e162bce33576b315ececbb6406837bf51f5n;
+    const mod = (x, m) => {
+        const r = x % m;
+        return r >= 0n ? r : r + m;
+    };
+    const inv = (x, m) => {
+        let [a, b, u, v] = [mod(x, m), m, 1n, 0n];
+        while (b !== 0n) {
+            const q = a / b;
+            [a, b] = [b, a - q * b];
+            [u, v] = [v, u - q * v];
+        }
+        return mod(u, m);
+    };
+    const toBig = (bytes) => bytes.reduce((acc, byte) => (acc << 8n) | BigInt(byte), 0n);
+    // Jacobian coordinates with a = -3, z = 0 is the point at infinity
+    const double = ([x, y, z]) => {
+        if (z === 0n || y === 0n) {
+            return [0n, 1n, 0n];
+        }
+        const delta = mod(z * z, p);
+        const gamma = mod(y * y, p);
+        const beta = mod(x * gamma, p);
+        const alpha = mod(3n * (x - delta) * (x + delta), p);
+        const x3 = mod(alpha * alpha - 8n * beta, p);
+        const z3 = mod((y + z) * (y + z) - gamma - delta, p);
+        const y3 = mod(alpha * (4n * beta - x3) - 8n * gamma * gamma, p);
+        return [x3, y3, z3];
+    };
+    const add = (P, Q) => {
+        if (P[2] === 0n) {
+            return Q;
+        }
+        if (Q[2] === 0n) {
+            return P;
+        }
+        const [x1, y1, z1] = P;
+        const [x2, y2, z2] = Q;
+        const z1z1 = mod(z1 * z1, p);
+        const z2z2 = mod(z2 * z2, p);
+        const u1 = mod(x1 * z2z2, p);
+        const u2 = mod(x2 * z1z1, p);
+        const s1 = mod(y1 * z2 * z2z2, p);
+        const s2 = mod(y2 * z1 * z1z1, p);
+        const h = mod(u2 - u1, p);
+        const r = mod(s2 - s1, p);
+        if (h === 0n) {
+            return r === 0n ? double(P) : [0n, 1n, 0n];
+        }
+        const hh = mod(h * h, p);
+        const hhh = mod(h * hh, p);
+        const v = mod(u1 * hh, p);
+        const x3 = mod(r * r - hhh - 2n * v, p);
+        const y3 = mod(r * (v - x3) - s1 * hhh, p);
+        return [x3, y3, mod(z1 * z2 * h, p)];
+    };
+
+    const d = toBig(HEAPU8.subarray(key, key + 32));
+    if (d === 0n || d >= n) {
+        return 0;
+    }
+    const e = toBig(HEAPU8.subarray(digest, digest + Math.min(digest_length, 32)));
+    const random = new Uint8Array(48); // Extra bytes make the nonce bias negligible
+    for (;;) {
+        crypto.getRandomValues(random);
+        const k = mod(toBig(random), n - 1n) + 1n;
+        let R = [0n, 1n, 0n];
+        for (let bit = 255n; bit >= 0n; bit--) {
+            R = double(R);
+            if ((k >> bit) & 1n) {
+                R = add(R, [gx, gy, 1n]);
             }
-            break;
         }
-        case yield_type::POLL_RESPONSE_BODY: {
-            // Retrieve fetch
-            auto it = fetches.find(uid);
-            if (it == fetches.end()) {
-                printf("failed to retrieve fetch\n");
-                return true;
+        const zinv = inv(R[2], p);
+        const r = mod(mod(R[0] * zinv * zinv, p), n);
+        const s = mod(inv(k, n) * (e + r * d), n);
+        if (r !== 0n && s !== 0n) {
+            const hex = r.toString(16).padStart(64, "0") + s.toString(16).padStart(64, "0");
+            for (let i = 0; i < 64; i++) {
+                HEAPU8[signature + i] = parseInt(hex.substr(i * 2, 2), 16);
             }
-            auto& o = it->second;
-            emscripten_fetch_t *fetch = o->fetch;
+            return 1;
+        }
+    }
+});
 
-            // Write body
-            if (cm_write_virtual_memory(machine, vaddr, (uint8_t*)(fetch->data), fetch->totalBytes) != 0) {
-                printf("failed to write virtual memory: %s\n", cm_get_last_error_message());
-                return false;
+// Sign for the guest, on failure it signs by itself
+static yield_result handle_sign(cm_machine *machine, uint64_t vaddr) {
+    yield_sign req;
+    if (cm_read_virtual_memory(machine, vaddr, reinterpret_cast<uint8_t*>(&req), sizeof(req)) != CM_ERROR_OK ||
+        req.version != YIELD_SIGN_VERSION || req.algorithm != static_cast<uint32_t>(sign_algorithm::ECDSA_P256) ||
+        req.digest_length == 0 || req.digest_length > sizeof(req.digest)) {
+        return yield_result::FAILED;
+    }
+    const bool signed_ok = js_ecdsa_p256_sign(req.key, req.digest, req.digest_length, req.signature) != 0;
+    memset(req.key, 0, sizeof(req.key));
+    if (!signed_ok) {
+        return yield_result::FAILED;
+    }
+    req.signature_length = 64;
+    if (cm_write_virtual_memory(machine, vaddr, reinterpret_cast<uint8_t*>(&req), sizeof(req)) != CM_ERROR_OK) {
+        return yield_result::FAILED;
+    }
+    return yield_result::OK;
+}
+
+// ENCRYPT request from the guest proxy, which offloads encryption of large TLS records.
+// Layout must match https-proxy/record_offload.hpp.
+static constexpr uint32_t YIELD_ENCRYPT_VERSION = 1;
+static constexpr uint64_t YIELD_ENCRYPT_MAX = 65536;
+static constexpr uint32_t YIELD_ENCRYPT_TAG_LENGTH = 16;
+
+enum class encrypt_algorithm : uint32_t {
+    AES_GCM = 1, // 128 or 256 bit key, 16 byte tag
+};
+
+struct yield_encrypt final {
+    uint32_t version{YIELD_ENCRYPT_VERSION};
+    uint32_t algorithm{0};
+    uint32_t key_length{0};
+    uint32_t iv_length{0};
+    uint32_t aad_length{0};
+    uint32_t tag_length{0}; // Filled by the host
+    uint64_t length{0}; // Plaintext bytes
+    uint64_t input{0}; // Guest virtual address of the plaintext
+    uint64_t output{0}; // Guest virtual address of the ciphertext, may be the same as input
+    uint8_t key[32]{};
+    uint8_t iv[16]{};
+    uint8_t aad[32]{};
+    uint8_t tag[16]{};
+};
+
+// AES-GCM encryption of data in place with WebCrypto, the tag is appended after length bytes.
+// Keys are imported once per TLS connection direction, records of the same connection reuse them.
+// Returns 0 on failure, for instance outside secure contexts where WebCrypto is missing.
+EM_ASYNC_JS(int, js_aes_gcm_encrypt, (const uint8_t *key, uint32_t key_length, const uint8_t *iv, uint32_t iv_length, const uint8_t *aad, uint32_t aad_length, uint8_t *data, uint32_t length), {
+    try {
+        if (!Module["webcmAesKeys"]) {
+            Module["webcmAesKeys"] = new Map();
+        }
+        const keys = Module["webcmAesKeys"];
+        // Copies, WebCrypto does not accept views of shared memory
+        const keyBytes = HEAPU8.slice(key, key + key_length);
+        const id = Array.from(keyBytes, (b) => b.toString(16).padStart(2, "0")).join("");
+        let cryptoKey = keys.get(id);
+        if (!cryptoKey) {
+            cryptoKey = await crypto.subtle.importKey("raw", keyBytes, "AES-GCM", false, ["encrypt"]);
+            if (keys.size >= 64) {
+                keys.delete(keys.keys().next().value);
             }
+            keys.set(id, cryptoKey);
+        }
+        const sealed = await crypto.subtle.encrypt({
+            name: "AES-GCM",
+            iv: HEAPU8.slice(iv, iv + iv_length),
+            additionalData: HEAPU8.slice(aad, aad + aad_length),
+            tagLength: 128,
+        }, cryptoKey, HEAPU8.slice(data, data + length));
+        HEAPU8.set(new Uint8Array(sealed), data);
+        return 1;
+    } catch (e) {
+        return 0;
+    }
+});
 
-            // Free
-            emscripten_fetch_close(fetch);
-            fetches.erase(it);
+// Encrypt a record for the guest, on failure it encrypts by itself
+static yield_result handle_encrypt(cm_machine *machine, uint64_t vaddr) {
+    yield_encrypt req;
+    if (cm_read_virtual_memory(machine, vaddr, reinterpret_cast<uint8_t*>(&req), sizeof(req)) != CM_ERROR_OK ||
+        req.version != YIELD_ENCRYPT_VERSION || req.algorithm != static_cast<uint32_t>(encrypt_algorithm::AES_GCM) ||
+        (req.key_length != 16 && req.key_length != 32) || req.iv_length == 0 || req.iv_length > sizeof(req.iv) ||
+        req.aad_length > sizeof(req.aad) || req.length == 0 || req.length > YIELD_ENCRYPT_MAX) {
+        return yield_result::FAILED;
+    }
+    // Reused across records, which are mostly the same size
+    static std::vector<uint8_t> data;
+    data.resize(req.length + YIELD_ENCRYPT_TAG_LENGTH);
+    bool ok = cm_read_virtual_memory(machine, req.input, data.data(), req.length) == CM_ERROR_OK &&
+        js_aes_gcm_encrypt(req.key, req.key_length, req.iv, req.iv_length, req.aad, req.aad_length, data.data(),
+            static_cast<uint32_t>(req.length)) != 0;
+    memset(req.key, 0, sizeof(req.key));
+    if (!ok || cm_write_virtual_memory(machine, req.output, data.data(), req.length) != CM_ERROR_OK) {
+        return yield_result::FAILED;
+    }
+    memcpy(req.tag, data.data() + req.length, YIELD_ENCRYPT_TAG_LENGTH);
+    req.tag_length = YIELD_ENCRYPT_TAG_LENGTH;
+    if (cm_write_virtual_memory(machine, vaddr, reinterpret_cast<uint8_t*>(&req), sizeof(req)) != CM_ERROR_OK) {
+        return yield_result::FAILED;
+    }
+    return yield_result::OK;
+}
+
+bool handle_softyield(cm_machine *machine) {
+    uint64_t type = 0;
+    cm_read_reg(machine, CM_REG_X10, &type); // a0
+
+    switch (static_cast<yield_type>(type)) {
+        case yield_type::SNAPSHOT: {
+            // Only meaningful when building a pre-booted snapshot
+            break;
+        }
+        case yield_type::GET_TIME: {
+            cm_write_reg(machine, CM_REG_X10, static_cast<uint64_t>(time(NULL))); // ret a0
+            return true;
+        }
+        case yield_type::SHELL_READY: {
+            record_boot_phase(boot_phase::SHELL_READY, machine);
             break;
         }
+        case yield_type::SIGN: {
+            uint64_t vaddr = 0;
+            cm_read_reg(machine, CM_REG_X11, &vaddr); // a1
+            cm_write_reg(machine, CM_REG_X10, static_cast<uint64_t>(handle_sign(machine, vaddr))); // ret a0
+            return true;
+        }
+        case yield_type::ENCRYPT: {
+            uint64_t vaddr = 0;
+            cm_read_reg(machine, CM_REG_X11, &vaddr); // a1
+            cm_write_reg(machine, CM_REG_X10, static_cast<uint64_t>(handle_encrypt(machine, vaddr))); // ret a0
+            return true;
+        }
         default:
             printf("invalid yield type\n");
             return false;
@@ -255,20 +1236,25 @@ bool handle_softyield(cm_machine *machine) {
 }
 
 int main() {
+    record_boot_phase(boot_phase::INSTANTIATE, nullptr);
     printf("Allocating...\n");
 
+#ifdef WEBCM_SNAPSHOT
+    // Stored configuration of the pre-booted machine, carrying its processor and device state
+    const std::string config(reinterpret_cast<const char*>(snapshot_config_json), sizeof(snapshot_config_json));
+#else
     // Set machine configuration
-    unsigned long long now = (unsigned long long)time(NULL);
     char config[4096];
     snprintf(config, sizeof(config), R"({
         "dtb": {
-            "bootargs": "quiet earlycon=sbi console=hvc1 root=/dev/pmem0 rw init=/usr/sbin/cartesi-init",
-            "init": "date -s @%llu >> /dev/null && https-proxy 127.254.254.254 80 443 > /dev/null 2>&1 &",
+            "bootargs": "quiet earlycon=sbi console=hvc1 root=/dev/pmem0 rootdelay=%d rw init=/usr/sbin/cartesi-init",
+            "init": "%s",
             "entrypoint": "exec ash -l"
         },
         "ram": {"length": %llu},
         "flash_drive": [
-            {"length": %llu}
+            {"length": %llu},
+            {"start": %llu, "length": %llu}
         ],
         "virtio": [
             {"type": "console"}
@@ -276,7 +1262,9 @@ int main() {
         "processor": {
             "iunrep": 1
         }
-    })", now, static_cast<unsigned long long>(RAM_SIZE), static_cast<unsigned long long>(ROOTFS_SIZE));
+    })", ROOT_DELAY_S, WEBCM_INIT, static_cast<unsigned long long>(RAM_SIZE), static_cast<unsigned long long>(ROOTFS_SIZE),
+        static_cast<unsigned long long>(RING_START), static_cast<unsigned long long>(RING_LENGTH));
+#endif
 
     const char runtime_config[] = R"({
         "soft_yield": true
@@ -284,30 +1272,126 @@ int main() {
 
     // Create a new machine
     cm_machine *machine = NULL;
-    if (cm_create_new(config, runtime_config, &machine) != CM_ERROR_OK) {
+    if (cm_create_new(std::data(config), runtime_config, &machine) != CM_ERROR_OK) {
         printf("failed to create machine: %s\n", cm_get_last_error_message());
         exit(1);
     }
+    record_boot_phase(boot_phase::CREATE, machine);
+
+#ifdef BENCH_DECOMPRESS
+    bench_decompress(machine, ROOTFS_START, rootfs_zzi, sizeof(rootfs_zzi));
+    cm_delete(machine);
+    return 0;
+#endif
 
     printf("Decompressing...\n");
 
-    // Decompress kernel and rootfs
-    uncompress_memory(machine, RAM_START, linux_bin_zz, sizeof(linux_bin_zz));
-    uncompress_memory(machine, ROOTFS_START, rootfs_ext2_zz, sizeof(rootfs_ext2_zz));
+    // Decompress RAM and rootfs, only their non-zero extents are written
+    image_env kernel;
+    image_open(&kernel, machine, RAM_START, ram_zzi, sizeof(ram_zzi));
+    image_env rootfs;
+    image_open(&rootfs, machine, ROOTFS_START, rootfs_zzi, sizeof(rootfs_zzi));
+#ifdef __EMSCRIPTEN_PTHREADS__
+    // Inflate extents across all host cores
+    const unsigned thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    image_fill_parallel(&kernel, thread_count);
+    record_boot_phase(boot_phase::KERNEL_DECOMPRESS, machine);
+    image_fill_parallel(&rootfs, thread_count);
+    bool rootfs_filled = true;
+#else
+    image_fill_step(&kernel, UINT64_MAX);
+    record_boot_phase(boot_phase::KERNEL_DECOMPRESS, machine);
+
+#ifdef WEBCM_SNAPSHOT
+    // The restored guest has its rootfs mounted already, so every chunk must be in place before it runs.
+    // Fill it in bounded steps, yielding to the browser in between to keep the page responsive.
+    while (!image_fill_step(&rootfs, ROOTFS_FILL_STEP)) {
+        emscripten_sleep(0);
+    }
+    bool rootfs_filled = true;
+#else
+    // The emulator offers no hook to trap the first guest access to a flash drive page. Instead the kernel waits
+    // ROOT_DELAY_S guest seconds before mounting the rootfs, and the rest of it is filled between run slices
+    // meanwhile, see the run loop. Only the head is read earlier, for the partition table when the drive is probed.
+    image_fill_below(&rootfs, ROOTFS_HEAD_BYTES);
+    bool rootfs_filled = false;
+#endif
+#endif
+    if (rootfs_filled) {
+        record_boot_phase(boot_phase::ROOTFS_DECOMPRESS, machine);
+    }
 
     printf("Booting...\n");
 
     // Run the machine
     cm_break_reason break_reason;
+    run_quantum quantum;
+    uint64_t mcycle;
+    uint64_t icycleinstret;
+    if (cm_read_reg(machine, CM_REG_MCYCLE, &mcycle) != CM_ERROR_OK ||
+        cm_read_reg(machine, CM_REG_ICYCLEINSTRET, &icycleinstret) != CM_ERROR_OK) {
+        printf("failed to read machine cycle: %s\n", cm_get_last_error_message());
+        cm_delete(machine);
+        exit(1);
+    }
+#ifdef WEBCM_SNAPSHOT
+    const uint64_t root_mount_mcycle = mcycle;
+#else
+    // The kernel mounts the rootfs no earlier than this, its root delay alone takes that much guest time.
+    // Until then the guest only runs up to it while the rootfs is being filled, and its idle time is not
+    // slept on, so the delay costs no wall-clock time.
+    const uint64_t root_mount_mcycle = mcycle + ROOT_DELAY_S * 1000 * RTC_CYCLES_PER_MS;
+#endif
+    listen_console();
     do {
-        uint64_t mcycle;
-        if (cm_read_reg(machine, CM_REG_MCYCLE, &mcycle) != CM_ERROR_OK) {
+        const uint64_t start_mcycle = mcycle;
+        const uint64_t start_icycleinstret = icycleinstret;
+        const double start_ms = emscripten_get_now();
+        // Keep slices short for a while after console input, so the guest echoes it promptly
+        uint64_t slice_cycles = quantum.slice_cycles;
+        if (quantum.cycles_per_ms > 0 && get_input_age_ms() < INPUT_BOOST_MS) {
+            slice_cycles = std::clamp(static_cast<uint64_t>(quantum.cycles_per_ms * INPUT_SLICE_BUDGET_MS), RUN_SLICE_MIN_CYCLES, slice_cycles);
+        }
+        uint64_t target_mcycle = start_mcycle + slice_cycles;
+        if (!rootfs_filled) {
+            if (start_mcycle >= root_mount_mcycle) {
+                // The fill fell behind the boot, finish it before the kernel can mount the rootfs
+                while (!image_fill_step(&rootfs, ROOTFS_FILL_STEP)) {
+                    emscripten_sleep(0);
+                }
+                rootfs_filled = true;
+                record_boot_phase(boot_phase::ROOTFS_DECOMPRESS, machine);
+            } else {
+                target_mcycle = std::min(target_mcycle, root_mount_mcycle);
+            }
+        }
+        if (cm_run(machine, target_mcycle, &break_reason) != CM_ERROR_OK) {
+            printf("failed to run machine: %s\n", cm_get_last_error_message());
+            cm_delete(machine);
+            exit(1);
+        }
+        const double elapsed_ms = emscripten_get_now() - start_ms;
+        if (cm_read_reg(machine, CM_REG_MCYCLE, &mcycle) != CM_ERROR_OK ||
+            cm_read_reg(machine, CM_REG_ICYCLEINSTRET, &icycleinstret) != CM_ERROR_OK) {
             printf("failed to read machine cycle: %s\n", cm_get_last_error_message());
             cm_delete(machine);
             exit(1);
         }
-        if (cm_run(machine, mcycle + 4*1024*1024, &break_reason) != CM_ERROR_OK) {
-            printf("failed to run machine: %s\n", cm_get_last_error_message());
+        // Cycles fast-forwarded while the guest waited for an interrupt do not retire instructions
+        const uint64_t cycles = mcycle - start_mcycle;
+        const uint64_t idle_cycles = std::min(icycleinstret - start_icycleinstret, cycles);
+        update_run_quantum(quantum, cycles - idle_cycles, elapsed_ms);
+        if (idle_cycles == 0) {
+            stats.busy_cycles += cycles;
+            stats.busy_ms += elapsed_ms;
+        }
+        record_boot_phase(boot_phase::FIRST_RUN, machine);
+        if (!rootfs_filled && image_fill_step(&rootfs, ROOTFS_BOOT_FILL_STEP)) {
+            rootfs_filled = true;
+            record_boot_phase(boot_phase::ROOTFS_DECOMPRESS, machine);
+        }
+        bool ring_progress = false;
+        if (!process_fetch_ring(machine, ring_progress)) {
             cm_delete(machine);
             exit(1);
         }
@@ -317,8 +1401,18 @@ int main() {
                 cm_delete(machine);
                 exit(1);
             }
+            emscripten_sleep(0);
+        } else if (cycles > 0 && idle_cycles * 10 >= cycles * 9 && !ring_progress && mcycle >= root_mount_mcycle) {
+            // The guest is mostly idle, instead of spinning give the host the guest time that was skipped,
+            // then hand over fetches that completed meanwhile before the guest runs again
+            wait_host_event(std::min<double>(static_cast<double>(idle_cycles) / RTC_CYCLES_PER_MS, IDLE_SLEEP_MAX_MS));
+            if (!process_fetch_ring(machine, ring_progress)) {
+                cm_delete(machine);
+                exit(1);
+            }
+        } else {
+            emscripten_sleep(0);
         }
-        emscripten_sleep(0);
     } while(break_reason == CM_BREAK_REASON_REACHED_TARGET_MCYCLE || break_reason == CM_BREAK_REASON_YIELDED_SOFTLY);
 
     // Print reason for run interruption
@@ -345,7 +1439,6 @@ int main() {
     }
 
     // Read and print machine cycles
-    uint64_t mcycle;
     if (cm_read_reg(machine, CM_REG_MCYCLE, &mcycle) != CM_ERROR_OK) {
         printf("failed to read machine cycle: %s\n", cm_get_last_error_message());
         cm_delete(machine);
@@ -0,0 +1,35 @@
+#ifndef ZZIMAGE_H
+#define ZZIMAGE_H
+
+#include <stdint.h>
+
+// Chunked compressed image container (.zzi).
+//
+// The non-zero pages of the image are grouped into extents that are compressed as
+// independent zlib streams, so any extent can be inflated on its own at its offset
+// in machine memory. Ranges not covered by an extent are holes that read as zero.
+// All fields are little-endian.
+//
+// Layout:
+//   zzi_header
+//   zzi_extent[extent_count] (sorted by offset)
+//   zlib streams
+
+#define ZZI_MAGIC "WCMZZI1"
+#define ZZI_PAGE_SIZE UINT64_C(4096)
+#define ZZI_CHUNK_SIZE (UINT64_C(1)*1024*1024)
+
+typedef struct zzi_header {
+    char magic[8];
+    uint64_t length; // Uncompressed image length
+    uint64_t extent_count;
+} zzi_header;
+
+typedef struct zzi_extent {
+    uint64_t offset; // Offset of the extent in the uncompressed image
+    uint64_t length; // Uncompressed length of the extent
+    uint64_t data_offset; // Offset of the zlib stream from the start of the container
+    uint64_t data_length; // Length of the zlib stream
+} zzi_extent;
+
+#endif // ZZIMAGE_H
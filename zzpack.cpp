@@ -0,0 +1,105 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_EXPORT static
+#include "third-party/miniz.h"
+#include "third-party/miniz.c"
+
+#include "zzimage.h"
+
+static std::vector<uint8_t> read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("failed to open '%s'\n", path);
+        exit(1);
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return data;
+}
+
+static bool is_zero_page(const std::vector<uint8_t> &image, uint64_t offset) {
+    const uint64_t end = std::min<uint64_t>(offset + ZZI_PAGE_SIZE, image.size());
+    return std::all_of(image.begin() + offset, image.begin() + end, [](uint8_t b) { return b == 0; });
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("Usage: zzpack <input> <output.zzi>\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> image = read_file(argv[1]);
+
+    // Split the non-zero runs of pages into chunks, compressing each one as an independent zlib stream.
+    // Zero pages are left out as holes, the machine memory they map to is already zeroed.
+    std::vector<zzi_extent> extents;
+    std::vector<uint8_t> streams;
+    uint64_t offset = 0;
+    while (offset < image.size()) {
+        if (is_zero_page(image, offset)) {
+            offset += ZZI_PAGE_SIZE;
+            continue;
+        }
+        uint64_t end = offset;
+        while (end < image.size() && end - offset < ZZI_CHUNK_SIZE && !is_zero_page(image, end)) {
+            end += ZZI_PAGE_SIZE;
+        }
+        const uint64_t length = std::min<uint64_t>(end, image.size()) - offset;
+        mz_ulong compressed_length = mz_compressBound(length);
+        std::vector<uint8_t> compressed(compressed_length);
+        if (mz_compress2(compressed.data(), &compressed_length, image.data() + offset, length, MZ_UBER_COMPRESSION) != MZ_OK) {
+            printf("failed to compress extent at offset %llu\n", (unsigned long long)offset);
+            return 1;
+        }
+        extents.push_back({offset, length, streams.size(), compressed_length});
+        streams.insert(streams.end(), compressed.begin(), compressed.begin() + compressed_length);
+        offset += length;
+    }
+
+    // Make stream offsets relative to the start of the container
+    zzi_header header{};
+    memcpy(header.magic, ZZI_MAGIC, sizeof(header.magic));
+    header.length = image.size();
+    header.extent_count = extents.size();
+    const uint64_t data_start = sizeof(zzi_header) + extents.size() * sizeof(zzi_extent);
+    for (zzi_extent &extent : extents) {
+        extent.data_offset += data_start;
+    }
+
+    uint64_t data_bytes = 0;
+    for (const zzi_extent &extent : extents) {
+        data_bytes += extent.length;
+    }
+
+    FILE *f = fopen(argv[2], "wb");
+    if (!f) {
+        printf("failed to open '%s'\n", argv[2]);
+        return 1;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(extents.data(), sizeof(zzi_extent), extents.size(), f) != extents.size() ||
+        fwrite(streams.data(), 1, streams.size(), f) != streams.size()) {
+        printf("failed to write '%s'\n", argv[2]);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    printf("%s: %llu bytes (%llu non-zero) in %llu extents, %llu bytes compressed\n", argv[2],
+        (unsigned long long)header.length, (unsigned long long)data_bytes, (unsigned long long)header.extent_count,
+        (unsigned long long)(data_start + streams.size()));
+    return 0;
+}